@@ -0,0 +1,175 @@
+#include "AccSelector.h"
+#include "LinearAcc.h"
+#include "GridAcc.h"
+#include "KdTreeAcc.h"
+#include "HybridAcc.h"
+#include "Utils.h"
+#include <stdio.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <chrono>
+#include <algorithm>
+
+void AccSelector::getStatistics(std::vector<Geometry *> *scene, Statistics &stats)
+{
+    stats.objects = (int)scene->size();
+    stats.rxSpheres = 0;
+    stats.gridCells = 0;
+    stats.occupancy = 0;
+    stats.imbalance = 1;
+    stats.flat = false;
+    if (scene->empty())
+        return;
+
+    // Bounding box of the scene
+    Point sceneMin(DBL_MAX, DBL_MAX, DBL_MAX);
+    Point sceneMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+    for (unsigned int i = 0; i < scene->size(); i++)
+    {
+        if ((*scene)[i]->type == SPHERE)
+            stats.rxSpheres += 1;
+
+        Point min, max;
+        (*scene)[i]->getBoundingBox(min, max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            sceneMin[axis] = std::min(sceneMin[axis], min[axis]);
+            sceneMax[axis] = std::max(sceneMax[axis], max[axis]);
+        }
+    }
+
+    Vector extent(sceneMin, sceneMax);
+    double maxLength = std::max(std::max(extent.x, extent.y), extent.z);
+    stats.flat = extent.z < 0.1 * std::max(extent.x, extent.y);
+    if (!(maxLength > 0))
+    {
+        stats.occupancy = 1;
+        return;
+    }
+
+    // Cells of GridAcc (the longest dimension is cut into 400 pieces)
+    double gridSize = maxLength / 399;
+    double gridCells = 1;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        gridCells *= (int)(extent[axis] / gridSize + 1.5);
+    }
+    stats.gridCells = (int)std::min(gridCells, (double)INT_MAX);
+
+    // Coarse grid of about one cell per object (for objects filling a volume),
+    // count the cells that hold the center of an object
+    int k = std::max(1, std::min(128, (int)ceil(pow((double)stats.objects, 1.0 / 3.0))));
+    double size = maxLength / k;
+    int n[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        n[axis] = std::max(1, std::min(k, (int)ceil(extent[axis] / size)));
+    }
+
+    std::vector<int> counts(n[0] * n[1] * n[2], 0);
+    int nonEmpty = 0;
+    int maxCount = 0;
+    for (unsigned int i = 0; i < scene->size(); i++)
+    {
+        Point c = (*scene)[i]->getCenter();
+        int index[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            index[axis] = std::max(0, std::min(n[axis] - 1, (int)((c[axis] - sceneMin[axis]) / size)));
+        }
+        int cell = (index[2] * n[1] + index[1]) * n[0] + index[0];
+        if (counts[cell]++ == 0)
+            nonEmpty += 1;
+        maxCount = std::max(maxCount, counts[cell]);
+    }
+    stats.occupancy = (double)nonEmpty / std::min((int)counts.size(), stats.objects);
+    stats.imbalance = maxCount / ((double)stats.objects / nonEmpty);
+}
+
+double AccSelector::probe(Accelerator *acc, const Point &origin)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    // Rays evenly spread over the sphere (Fibonacci lattice), reflected like
+    // the traced rays
+    const double golden = PI * (3 - sqrt(5.0));
+    std::vector<RxIntersection> rxSpheres;
+    for (int i = 0; i < ProbeRays; i++)
+    {
+        double z = 1 - (i + 0.5) * 2.0 / ProbeRays;
+        double r = sqrt(1 - z * z);
+        Ray ray(origin, Vector(r * cos(golden * i), r * sin(golden * i), z), 0);
+
+        for (int depth = 0; depth <= ProbeDepth; depth++)
+        {
+            rxSpheres.clear();
+            IntersectResult result = acc->intersect(ray, rxSpheres);
+            if (!result.hit)
+                break;
+
+            Vector nl = (result.normal.dot(ray.direction) < 0) ? result.normal : result.normal * -1;
+            Vector v = ray.direction - nl * 2 * nl.dot(ray.direction);
+            ray = Ray(result.position, v, 0);
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count();
+}
+
+Accelerator *AccSelector::select(std::vector<Geometry *> *scene, const Point &txPoint)
+{
+    Statistics stats;
+    getStatistics(scene, stats);
+    fprintf(stderr, "    Auto preprocess: %d objects (%d rx spheres), occupancy %.2f, imbalance %.1f, grid cells %d%s\n",
+        stats.objects, stats.rxSpheres, stats.occupancy, stats.imbalance, stats.gridCells, stats.flat ? ", flat" : "");
+
+    Accelerator *acc = NULL;
+    if (stats.objects <= LinearMaxObjects)
+    {
+        fprintf(stderr, "    Auto preprocess: Linear (tiny scene)\n");
+        acc = new LinearAcc(scene);
+    }
+    else if (stats.objects >= HybridMinObjects && stats.flat)
+    {
+        fprintf(stderr, "    Auto preprocess: Hybrid (large flat scene)\n");
+        acc = new HybridAcc(scene);
+    }
+    else if (stats.gridCells > GridMaxCells)
+    {
+        fprintf(stderr, "    Auto preprocess: Kd-tree (the grid would need %d cells)\n", stats.gridCells);
+        acc = new KdTreeAcc(scene);
+    }
+    else if (stats.occupancy >= 0.45 && stats.imbalance <= GridMaxImbalance)
+    {
+        fprintf(stderr, "    Auto preprocess: Grid (evenly spread objects)\n");
+        acc = new GridAcc(scene);
+    }
+    else if (stats.occupancy <= 0.05)
+    {
+        fprintf(stderr, "    Auto preprocess: Kd-tree (clustered objects)\n");
+        acc = new KdTreeAcc(scene);
+    }
+
+    if (acc != NULL)
+    {
+        acc->init();
+        return acc;
+    }
+
+    // Not conclusive: time the probe rays on both
+    Accelerator *grid = new GridAcc(scene);
+    Accelerator *kdTree = new KdTreeAcc(scene);
+    grid->init();
+    kdTree->init();
+
+    double gridTime = probe(grid, txPoint);
+    double kdTreeTime = probe(kdTree, txPoint);
+    bool useGrid = gridTime < kdTreeTime;
+    fprintf(stderr, "    Auto preprocess: %s (probe rays: grid %.1lf ms, kd-tree %.1lf ms)\n",
+        useGrid ? "Grid" : "Kd-tree", gridTime * 1000, kdTreeTime * 1000);
+
+    delete (useGrid ? kdTree : grid);
+    return useGrid ? grid : kdTree;
+}
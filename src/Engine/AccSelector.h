@@ -0,0 +1,46 @@
+#ifndef ACC_SELECTOR_H
+#define ACC_SELECTOR_H
+
+#include "Accelerator.h"
+
+// Picks the accelerator for RtPreprocessMethod::Auto.
+//
+// The choice is made from scene statistics first:
+//   - tiny scenes (a few dozen objects) are tested linearly
+//   - large flat scenes (city-scale) go to the hybrid grid of kd-trees
+//   - scenes whose objects fill space evenly go to the uniform grid
+//   - clustered scenes (most cells of a coarse grid empty) go to the kd-tree
+//   - the grid is never chosen when its cell count would be too large or
+//     some of its cells would be overfull
+// When the statistics are not conclusive, the grid and the kd-tree are both
+// built and a small probe set of rays from the tx point is timed on them.
+class AccSelector
+{
+public:
+    struct Statistics
+    {
+        int objects; // triangles, rx spheres, ...
+        int rxSpheres;
+        int gridCells; // cells GridAcc would allocate
+        double occupancy; // non-empty cells of a coarse grid / min(cells, objects)
+        double imbalance; // objects in the fullest cell / mean of the non-empty cells
+        bool flat; // the height is small compared to the width and the depth
+    };
+
+    static const int LinearMaxObjects = 48;
+    static const int GridMaxCells = 16 * 1024 * 1024;
+    static const int GridMaxImbalance = 32;
+    static const int HybridMinObjects = 100000;
+    static const int ProbeRays = 4096;
+    static const int ProbeDepth = 2; // reflections of each probe ray
+
+private:
+    static void getStatistics(std::vector<Geometry *> *scene, Statistics &stats);
+    static double probe(Accelerator *acc, const Point &origin);
+
+public:
+    // Returns the chosen accelerator, already initialized
+    static Accelerator *select(std::vector<Geometry *> *scene, const Point &txPoint);
+};
+
+#endif
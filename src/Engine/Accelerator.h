@@ -18,7 +18,17 @@ protected:
 
 public:
     Accelerator(std::vector<Geometry *> *scene) : scene(scene) {}
+    virtual ~Accelerator() {}
     virtual void init() = 0;
+
+    // Apply a scene edit in place, after the objects have been added to /
+    // removed from the scene (the removed ones are still valid). Returns false
+    // when the structure would degrade, init() has to rebuild it then.
+    virtual bool update(const std::vector<Geometry *> & /* added */, const std::vector<Geometry *> & /* removed */)
+    {
+        return false;
+    }
+
     virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints) = 0;
 };
 
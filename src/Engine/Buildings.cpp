@@ -0,0 +1,290 @@
+#include "Buildings.h"
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+
+Buildings::Buildings()
+    : x0(0), y0(0), cellSize(1), xLength(0), yLength(0), zMin(0), zMax(0)
+{
+    type = GeometryType::BUILDINGS;
+}
+
+bool Buildings::add(const double *x, const double *y, int n, double base, double height, int material)
+{
+    if (n < 3 || height <= 0)
+        return false;
+
+    Footprint f;
+    f.first = (int)xs.size();
+    f.count = n;
+    f.zMin = base;
+    f.zMax = base + height;
+    f.material = (unsigned short)material;
+    f.xMin = f.yMin = DBL_MAX;
+    f.xMax = f.yMax = -DBL_MAX;
+
+    // Make the polygon counter-clockwise, so that the wall normals point outwards
+    double area = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int j = (i + 1) % n;
+        area += x[i] * y[j] - x[j] * y[i];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int k = (area >= 0) ? i : n - 1 - i;
+        xs.push_back(x[k]);
+        ys.push_back(y[k]);
+        f.xMin = std::min(f.xMin, x[k]);
+        f.yMin = std::min(f.yMin, y[k]);
+        f.xMax = std::max(f.xMax, x[k]);
+        f.yMax = std::max(f.yMax, y[k]);
+    }
+
+    f.firstFacet = reserveIndexes(n + 2);
+    footprints.push_back(f);
+    return true;
+}
+
+void Buildings::build()
+{
+    double xMax = -DBL_MAX, yMax = -DBL_MAX;
+    x0 = y0 = DBL_MAX;
+    zMin = DBL_MAX;
+    zMax = -DBL_MAX;
+    double totalArea = 0;
+
+    for (unsigned int i = 0; i < footprints.size(); i++)
+    {
+        const Footprint &f = footprints[i];
+        x0 = std::min(x0, f.xMin);
+        y0 = std::min(y0, f.yMin);
+        xMax = std::max(xMax, f.xMax);
+        yMax = std::max(yMax, f.yMax);
+        zMin = std::min(zMin, f.zMin);
+        zMax = std::max(zMax, f.zMax);
+        totalArea += (f.xMax - f.xMin) * (f.yMax - f.yMin);
+    }
+
+    if (footprints.empty())
+    {
+        x0 = y0 = xMax = yMax = zMin = zMax = 0;
+    }
+
+    // About one footprint per cell, at most 1024 x 1024 cells
+    double width = xMax - x0;
+    double height = yMax - y0;
+    cellSize = footprints.empty() ? 1.0 : sqrt(std::max(totalArea, width * height) / footprints.size());
+    cellSize = std::max(cellSize, std::max(width, height) / 1024.0);
+    if (cellSize <= 0)
+        cellSize = 1.0;
+
+    xLength = (int)(width / cellSize) + 1;
+    yLength = (int)(height / cellSize) + 1;
+
+    cells.clear();
+    cells.resize(xLength * yLength);
+
+    for (unsigned int m = 0; m < footprints.size(); m++)
+    {
+        const Footprint &f = footprints[m];
+        int i_begin = (int)((f.xMin - x0) / cellSize);
+        int j_begin = (int)((f.yMin - y0) / cellSize);
+        int i_end = std::min((int)((f.xMax - x0) / cellSize), xLength - 1);
+        int j_end = std::min((int)((f.yMax - y0) / cellSize), yLength - 1);
+
+        for (int i = i_begin; i <= i_end; i++)
+        {
+            for (int j = j_begin; j <= j_end; j++)
+            {
+                cells[j * xLength + i].push_back(m);
+            }
+        }
+    }
+}
+
+Point Buildings::getCenter() const
+{
+    return Point(x0 + xLength * cellSize / 2, y0 + yLength * cellSize / 2, (zMin + zMax) / 2);
+}
+
+void Buildings::getBoundingBox(Point &min, Point &max) const
+{
+    min = Point(x0, y0, zMin);
+    max = Point(x0 + xLength * cellSize, y0 + yLength * cellSize, zMax);
+}
+
+// Point in polygon (crossing number)
+bool Buildings::inside(const Footprint &f, double x, double y) const
+{
+    bool in = false;
+    for (int i = 0, j = f.count - 1; i < f.count; j = i++)
+    {
+        double xi = xs[f.first + i], yi = ys[f.first + i];
+        double xj = xs[f.first + j], yj = ys[f.first + j];
+        if ((yi > y) != (yj > y) && x < (xj - xi) * (y - yi) / (yj - yi) + xi)
+            in = !in;
+    }
+    return in;
+}
+
+bool Buildings::intersectFootprint(const Ray &ray, int index, double tMax, IntersectResult &result) const
+{
+    const Footprint &f = footprints[index];
+    const double tMin = 0.0005f;
+    bool hit = false;
+
+    // Walls
+    for (int i = 0; i < f.count; i++)
+    {
+        int j = (i + 1 == f.count) ? 0 : i + 1;
+        double ax = xs[f.first + i], ay = ys[f.first + i];
+        double ex = xs[f.first + j] - ax, ey = ys[f.first + j] - ay;
+
+        // origin + t * dir = a + s * e (in xy)
+        double det = ray.direction.x * (-ey) - ray.direction.y * (-ex);
+        if (fabs(det) < 1e-12)
+            continue;
+        double bx = ax - ray.origin.x, by = ay - ray.origin.y;
+        double t = (bx * (-ey) - by * (-ex)) / det;
+        double s = (ray.direction.x * by - ray.direction.y * bx) / det;
+        if (t < tMin || t >= tMax || s < -0.0001 || s > 1.0001)
+            continue;
+
+        double z = ray.origin.z + ray.direction.z * t;
+        if (z < f.zMin || z > f.zMax)
+            continue;
+
+        tMax = t;
+        hit = true;
+        result.distance = t;
+        result.facet = f.firstFacet + i;
+        result.normal = Vector(ey, -ex, 0).norm(); // right of a counter-clockwise edge = outside
+    }
+
+    // Roof and floor
+    if (fabs(ray.direction.z) > 1e-12)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            double z = (k == 0) ? f.zMax : f.zMin;
+            double t = (z - ray.origin.z) / ray.direction.z;
+            if (t < tMin || t >= tMax)
+                continue;
+            if (!inside(f, ray.origin.x + ray.direction.x * t, ray.origin.y + ray.direction.y * t))
+                continue;
+
+            tMax = t;
+            hit = true;
+            result.distance = t;
+            result.facet = f.firstFacet + f.count + k;
+            result.normal = Vector(0, 0, (k == 0) ? 1 : -1);
+        }
+    }
+
+    if (hit)
+    {
+        result.hit = true;
+        result.geometry = (Geometry *)this;
+        result.material = f.material;
+        result.position = ray.getPoint(result.distance);
+    }
+    return hit;
+}
+
+unsigned int Buildings::hash(unsigned int seed) const
+{
+    for (unsigned int i = 0; i < footprints.size(); i++)
+    {
+        const Footprint &f = footprints[i];
+        double heights[2] = { f.zMin, f.zMax };
+        seed = hashBytes(seed, &f.count, sizeof(int));
+        seed = hashBytes(seed, heights, sizeof(heights));
+        seed = hashBytes(seed, &f.material, sizeof(f.material));
+    }
+    if (!xs.empty())
+    {
+        seed = hashBytes(seed, &xs[0], (int)(xs.size() * sizeof(double)));
+        seed = hashBytes(seed, &ys[0], (int)(ys.size() * sizeof(double)));
+    }
+    return seed;
+}
+
+IntersectResult Buildings::intersect(Ray &ray)
+{
+    IntersectResult result(false);
+    if (footprints.empty())
+        return result;
+
+    // Clip the ray to the grid
+    double t0 = 0, t1 = DBL_MAX;
+    double lo[3] = { x0, y0, zMin };
+    double hi[3] = { x0 + xLength * cellSize, y0 + yLength * cellSize, zMax };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double o = ray.origin[axis];
+        double d = ray.direction[axis];
+        if (fabs(d) < 1e-12)
+        {
+            if (o < lo[axis] || o > hi[axis])
+                return result;
+            continue;
+        }
+        double ta = (lo[axis] - o) / d;
+        double tb = (hi[axis] - o) / d;
+        if (ta > tb)
+            std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    if (t0 > t1)
+        return result;
+
+    // 2D DDA over the cells
+    double px = ray.origin.x + ray.direction.x * t0;
+    double py = ray.origin.y + ray.direction.y * t0;
+    int i = std::min(std::max((int)((px - x0) / cellSize), 0), xLength - 1);
+    int j = std::min(std::max((int)((py - y0) / cellSize), 0), yLength - 1);
+
+    int stepX = ray.direction.x >= 0 ? 1 : -1;
+    int stepY = ray.direction.y >= 0 ? 1 : -1;
+    double tDeltaX = fabs(ray.direction.x) > 1e-12 ? cellSize / fabs(ray.direction.x) : DBL_MAX;
+    double tDeltaY = fabs(ray.direction.y) > 1e-12 ? cellSize / fabs(ray.direction.y) : DBL_MAX;
+    double tNextX = fabs(ray.direction.x) > 1e-12 ?
+        (x0 + (i + (stepX > 0 ? 1 : 0)) * cellSize - ray.origin.x) / ray.direction.x : DBL_MAX;
+    double tNextY = fabs(ray.direction.y) > 1e-12 ?
+        (y0 + (j + (stepY > 0 ? 1 : 0)) * cellSize - ray.origin.y) / ray.direction.y : DBL_MAX;
+
+    double tMax = DBL_MAX;
+    while (true)
+    {
+        const std::vector<int> &cell = cells[j * xLength + i];
+        for (unsigned int m = 0; m < cell.size(); m++)
+        {
+            if (intersectFootprint(ray, cell[m], tMax, result))
+                tMax = result.distance;
+        }
+
+        // A hit inside the current cell cannot be beaten by the later cells
+        double tExit = std::min(tNextX, tNextY);
+        if (result.hit && tMax <= tExit)
+            break;
+        if (tExit > t1)
+            break;
+
+        if (tNextX < tNextY)
+        {
+            i += stepX;
+            tNextX += tDeltaX;
+        }
+        else
+        {
+            j += stepY;
+            tNextY += tDeltaY;
+        }
+        if (i < 0 || i >= xLength || j < 0 || j >= yLength)
+            break;
+    }
+
+    return result;
+}
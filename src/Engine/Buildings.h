@@ -0,0 +1,60 @@
+#ifndef BUILDINGS_H
+#define BUILDINGS_H
+
+#include <vector>
+#include "Geometry.h"
+
+// 2.5D buildings: footprint polygons extruded between a base and a roof height
+//
+// The walls, roofs and floors are intersected analytically, so a building
+// costs its footprint vertices instead of two triangles per wall and a
+// triangulated roof. The footprints are kept in a uniform 2D grid, which a
+// ray walks cell by cell (2D DDA) in its xy projection. Every wall, roof and
+// floor is a facet with its own index, so reflection paths are told apart
+// like paths on triangles.
+class Buildings : public Geometry
+{
+private:
+    struct Footprint
+    {
+        int first;        // first vertex
+        int count;        // number of vertices (= number of walls)
+        double zMin;      // base
+        double zMax;      // roof
+        double xMin, yMin, xMax, yMax;
+        int firstFacet;   // walls, then roof, then floor
+        unsigned short material;
+    };
+
+    std::vector<Footprint> footprints;
+    std::vector<double> xs; // vertices of all footprints, counter-clockwise
+    std::vector<double> ys;
+
+    // 2D grid of footprints
+    double x0;
+    double y0;
+    double cellSize;
+    int xLength;
+    int yLength;
+    std::vector<std::vector<int> > cells;
+    double zMin;
+    double zMax;
+
+private:
+    bool inside(const Footprint &f, double x, double y) const;
+    bool intersectFootprint(const Ray &ray, int index, double tMax, IntersectResult &result) const;
+
+public:
+    Buildings();
+
+    bool add(const double *x, const double *y, int n, double base, double height, int material);
+    int count() const { return (int)footprints.size(); }
+    void build(); // (re)build the grid after adding footprints
+
+    virtual Point getCenter() const;
+    virtual void getBoundingBox(Point &min, Point &max) const;
+    virtual IntersectResult intersect(Ray &ray);
+    virtual unsigned int hash(unsigned int seed) const;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "Checkpoint.h"
+#include <stdio.h>
+#include <string.h>
+
+bool operator==(const CheckpointHeader &left, const CheckpointHeader &right)
+{
+    return
+        left.traceMethod == right.traceMethod &&
+        left.nColumns == right.nColumns &&
+        left.nRows == right.nRows &&
+        left.nRx == right.nRx &&
+        left.maxReflections == right.maxReflections &&
+        left.raySpacing == right.raySpacing &&
+        left.frequency == right.frequency &&
+        left.permittivity == right.permittivity &&
+        left.conductivity == right.conductivity &&
+        left.txPower == right.txPower &&
+        left.txPoint[0] == right.txPoint[0] &&
+        left.txPoint[1] == right.txPoint[1] &&
+        left.txPoint[2] == right.txPoint[2] &&
+        left.rxRadius == right.rxRadius &&
+        left.launchJitter == right.launchJitter &&
+        left.launchSeed == right.launchSeed &&
+        left.diffraction == right.diffraction &&
+        left.diffractionRadius == right.diffractionRadius &&
+        left.transmission == right.transmission &&
+        left.wallThickness == right.wallThickness &&
+        left.maxTransmissions == right.maxTransmissions &&
+        left.powerFloor == right.powerFloor &&
+        left.maxBranches == right.maxBranches &&
+        left.nMaterials == right.nMaterials &&
+        left.materialHash == right.materialHash &&
+        left.sceneHash == right.sceneHash &&
+        left.rxHash == right.rxHash;
+}
+
+Checkpoint::Checkpoint()
+{
+    busy = false;
+}
+
+Checkpoint::~Checkpoint()
+{
+    Wait();
+}
+
+void Checkpoint::write(std::string filename, std::vector<char> *buffer, std::atomic<bool> *busy)
+{
+    // Write to a temporary file first, so that an interrupted write
+    // never destroys the previous checkpoint
+    std::string tmpFilename = filename + ".tmp";
+
+    FILE *fp = NULL;
+    if (fopen_s(&fp, tmpFilename.c_str(), "wb") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", tmpFilename.c_str());
+    }
+    else
+    {
+        size_t written = fwrite(&(*buffer)[0], 1, buffer->size(), fp);
+        fclose(fp);
+
+        if (written != buffer->size())
+        {
+            fprintf(stderr, "Error: Cannot write checkpoint \"%s\"\n", tmpFilename.c_str());
+        }
+        else
+        {
+            remove(filename.c_str());
+            rename(tmpFilename.c_str(), filename.c_str());
+        }
+    }
+
+    delete buffer;
+    *busy = false;
+}
+
+bool Checkpoint::Save(const char *filename, const CheckpointHeader &header, std::vector<RxFields> &fields)
+{
+    if (busy)
+        return false; // never wait for the disk
+
+    if (writer.joinable())
+        writer.join(); // already finished
+
+    // Snapshot
+    int fileVersion = version;
+    std::vector<char> *buffer = new std::vector<char>();
+    buffer->insert(buffer->end(), "RTCP", "RTCP" + 4);
+    buffer->insert(buffer->end(), (const char *)&fileVersion, (const char *)&fileVersion + sizeof(int));
+    buffer->insert(buffer->end(), (const char *)&header, (const char *)&header + sizeof(CheckpointHeader));
+    for (unsigned int i = 0; i < fields.size(); i++)
+    {
+        fields[i].Dump(*buffer);
+    }
+
+    busy = true;
+    writer = std::thread(write, std::string(filename), buffer, &busy);
+    return true;
+}
+
+void Checkpoint::Wait()
+{
+    if (writer.joinable())
+        writer.join();
+}
+
+bool Checkpoint::Load(const char *filename, const CheckpointHeader &expected, CheckpointHeader &header, std::vector<RxFields> &fields)
+{
+    // Read the whole file
+    FILE *fp = NULL;
+    if (fopen_s(&fp, filename, "rb") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", filename);
+        return false;
+    }
+
+    std::vector<char> buffer;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        buffer.insert(buffer.end(), chunk, chunk + n);
+    }
+    fclose(fp);
+
+    // Check header
+    const char *p = buffer.empty() ? NULL : &buffer[0];
+    const char *end = p + buffer.size();
+    int fileVersion = 0;
+
+    if (buffer.size() < 4 + sizeof(int) + sizeof(CheckpointHeader) ||
+        memcmp(p, "RTCP", 4) != 0)
+    {
+        fprintf(stderr, "Error: \"%s\" is not a checkpoint file\n", filename);
+        return false;
+    }
+    memcpy(&fileVersion, p + 4, sizeof(int));
+    if (fileVersion != version)
+    {
+        fprintf(stderr, "Error: Unsupported checkpoint version %d\n", fileVersion);
+        return false;
+    }
+    memcpy(&header, p + 4 + sizeof(int), sizeof(CheckpointHeader));
+    p += 4 + sizeof(int) + sizeof(CheckpointHeader);
+
+    if (!(header == expected))
+    {
+        fprintf(stderr, "Error: Checkpoint \"%s\" does not match the current scene and settings\n", filename);
+        return false;
+    }
+
+    // Every rx point has at least its path count
+    if (header.nRx < 0 || header.nRx > (end - p) / (int)sizeof(int))
+    {
+        fprintf(stderr, "Error: Checkpoint \"%s\" is truncated\n", filename);
+        return false;
+    }
+
+    // Read fields
+    fields.assign(header.nRx, RxFields());
+    for (int i = 0; i < header.nRx; i++)
+    {
+        p = fields[i].Load(p, end);
+        if (p == NULL)
+        {
+            fprintf(stderr, "Error: Checkpoint \"%s\" is truncated\n", filename);
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <string>
+#include "RxFields.h"
+
+// Describes the run a checkpoint belongs to. A checkpoint is only accepted
+// when every field except nextColumn and spillRuns matches the current settings.
+struct CheckpointHeader
+{
+    int traceMethod;
+    int nColumns; // see get_launch_size() in Engine.cpp
+    int nRows;
+    int nRx;
+    int maxReflections;
+    double raySpacing;
+    double frequency;
+    double permittivity;
+    double conductivity;
+    double txPower;
+    double txPoint[3];
+    double rxRadius;
+    int launchJitter; // 0 = regular launch grid
+    unsigned int launchSeed;
+    int diffraction; // 0 = off
+    double diffractionRadius;
+    int transmission; // 0 = off
+    double wallThickness;
+    int maxTransmissions;
+    double powerFloor;
+    int maxBranches;
+    int nMaterials; // the materials of AddMaterial()
+    unsigned int materialHash;
+    unsigned int sceneHash; // Geometry::hash() of the triangles and primitives (rx spheres excluded)
+    unsigned int rxHash; // of the rx coordinates
+
+    int nextColumn; // launch columns [0, nextColumn) have been traced
+    int spillRuns; // rx fields spilled to disk before the checkpoint (see RxSpill)
+};
+
+bool operator==(const CheckpointHeader &left, const CheckpointHeader &right); // ignores nextColumn and spillRuns
+
+// Checkpoint file layout:
+//   char magic[4] ("RTCP"), int version, CheckpointHeader header
+//   nRx * RxFields records (see RxFields::Dump)
+//
+// Save() serializes the fields into memory on the calling thread and hands the
+// buffer to a background thread for the disk write, so tracing is not blocked by I/O.
+// If the previous write is still in progress the new checkpoint is skipped.
+class Checkpoint
+{
+private:
+    static const int version = 10;
+
+    std::thread writer;
+    std::atomic<bool> busy;
+
+private:
+    static void write(std::string filename, std::vector<char> *buffer, std::atomic<bool> *busy);
+
+public:
+    Checkpoint();
+    ~Checkpoint();
+
+    bool Save(const char *filename, const CheckpointHeader &header, std::vector<RxFields> &fields);
+    void Wait();
+
+    // Fails without reading the fields when the header does not match "expected"
+    static bool Load(const char *filename, const CheckpointHeader &expected, CheckpointHeader &header, std::vector<RxFields> &fields);
+};
+
+#endif
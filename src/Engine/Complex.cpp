@@ -1,5 +1,6 @@
 #include "Complex.h"
 #include <math.h>
+#include <emmintrin.h>
 
 ComplexNumber::ComplexNumber(double a, double b)
 {
@@ -54,7 +55,7 @@ ComplexNumber ComplexNumber::operator/(const ComplexNumber &v) const
     // c + di   (c + di)*(c - di)     c^2 + d^2       c^2 + d^2
     double c = v.a;
     double d = v.b;
-    double r = sqrt(c * c + d * d);
+    double r = c * c + d * d;
     return ComplexNumber((a * c + b * d) / r, (b * c - a * d) / r);
 }
 
@@ -88,6 +89,96 @@ ComplexNumber ComplexNumber::Euler(double A, double phi)
     return ComplexNumber(A * cos(phi), A * sin(phi));
 }
 
+// sin(x) and cos(x) of two phases
+//
+// x = q * pi/2 + r, |r| <= pi/4, with pi/2 split in three parts (fdlibm), the
+// first two with 33 bits, so q * part is exact for |q| < 2^20. sin(r) and
+// cos(r) are the minimax polynomials of fdlibm, and q mod 4 swaps and negates
+// them. The error against libm is below 1e-15 (see Tests/ComplexTest.cpp).
+static void sincos2(__m128d x, __m128d &s, __m128d &c)
+{
+    const __m128d pio2_1 = _mm_set1_pd(1.57079632673412561417e+00);
+    const __m128d pio2_2 = _mm_set1_pd(6.07710050630396597660e-11);
+    const __m128d pio2_3 = _mm_set1_pd(2.02226624879595063154e-21);
+    const __m128d sign = _mm_set1_pd(-0.0);
+
+    __m128i q = _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(6.36619772367581382433e-01))); // round to nearest
+    __m128d qd = _mm_cvtepi32_pd(q);
+    __m128d r = _mm_sub_pd(x, _mm_mul_pd(qd, pio2_1));
+    r = _mm_sub_pd(r, _mm_mul_pd(qd, pio2_2));
+    r = _mm_sub_pd(r, _mm_mul_pd(qd, pio2_3));
+    __m128d z = _mm_mul_pd(r, r);
+
+    // sin(r) = r + r^3 * (S1 + z * (S2 + ... + z * S6))
+    __m128d ps = _mm_set1_pd(1.58969099521155010221e-10);
+    ps = _mm_add_pd(_mm_mul_pd(ps, z), _mm_set1_pd(-2.50507602534068634195e-08));
+    ps = _mm_add_pd(_mm_mul_pd(ps, z), _mm_set1_pd(2.75573137070700676789e-06));
+    ps = _mm_add_pd(_mm_mul_pd(ps, z), _mm_set1_pd(-1.98412698298579493134e-04));
+    ps = _mm_add_pd(_mm_mul_pd(ps, z), _mm_set1_pd(8.33333333332248946124e-03));
+    ps = _mm_add_pd(_mm_mul_pd(ps, z), _mm_set1_pd(-1.66666666666666324348e-01));
+    __m128d sr = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(r, z), ps));
+
+    // cos(r) = 1 - z / 2 + z^2 * (C1 + z * (C2 + ... + z * C6))
+    __m128d pc = _mm_set1_pd(-1.13596475577881948265e-11);
+    pc = _mm_add_pd(_mm_mul_pd(pc, z), _mm_set1_pd(2.08757232129817482790e-09));
+    pc = _mm_add_pd(_mm_mul_pd(pc, z), _mm_set1_pd(-2.75573143513906633035e-07));
+    pc = _mm_add_pd(_mm_mul_pd(pc, z), _mm_set1_pd(2.48015872894767294178e-05));
+    pc = _mm_add_pd(_mm_mul_pd(pc, z), _mm_set1_pd(-1.38888888888741095749e-03));
+    pc = _mm_add_pd(_mm_mul_pd(pc, z), _mm_set1_pd(4.16666666666666019037e-02));
+    __m128d cr = _mm_add_pd(_mm_sub_pd(_mm_set1_pd(1.0), _mm_mul_pd(z, _mm_set1_pd(0.5))),
+                            _mm_mul_pd(_mm_mul_pd(z, z), pc));
+
+    // Quadrant q mod 4 (q of each phase in both halves of its lane):
+    //   0: (sin r, cos r), 1: (cos r, -sin r), 2: (-sin r, -cos r), 3: (-cos r, sin r)
+    __m128i qq = _mm_shuffle_epi32(q, _MM_SHUFFLE(1, 1, 0, 0));
+    __m128i one = _mm_set1_epi32(1);
+    __m128i two = _mm_set1_epi32(2);
+    __m128d swap = _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(qq, one), one));
+    __m128d negSin = _mm_and_pd(sign, _mm_castsi128_pd(_mm_cmpeq_epi32(_mm_and_si128(qq, two), two)));
+    __m128d negCos = _mm_and_pd(sign, _mm_castsi128_pd(
+        _mm_cmpeq_epi32(_mm_and_si128(_mm_add_epi32(qq, one), two), two)));
+
+    s = _mm_xor_pd(_mm_or_pd(_mm_and_pd(swap, cr), _mm_andnot_pd(swap, sr)), negSin);
+    c = _mm_xor_pd(_mm_or_pd(_mm_and_pd(swap, sr), _mm_andnot_pd(swap, cr)), negCos);
+}
+
+void ComplexNumber::Euler(const double *A, const double *phi, double *re, double *im, int n)
+{
+    const __m128d maxPhase = _mm_set1_pd(1e6); // |q| < 2^20
+    const __m128d sign = _mm_set1_pd(-0.0);
+
+    for (int i = 0; i < n; i += 2)
+    {
+        // The last odd phase is evaluated in the same way, so that the
+        // result of a phase does not depend on its position
+        double a[2] = { A[i], i + 1 < n ? A[i + 1] : 0 };
+        double x[2] = { phi[i], i + 1 < n ? phi[i + 1] : 0 };
+        double s[2], c[2];
+
+        __m128d v = _mm_loadu_pd(x);
+        if (_mm_movemask_pd(_mm_cmpgt_pd(_mm_andnot_pd(sign, v), maxPhase)) != 0)
+        {
+            s[0] = sin(x[0]); c[0] = cos(x[0]);
+            s[1] = sin(x[1]); c[1] = cos(x[1]);
+        }
+        else
+        {
+            __m128d vs, vc;
+            sincos2(v, vs, vc);
+            _mm_storeu_pd(s, vs);
+            _mm_storeu_pd(c, vc);
+        }
+
+        re[i] = a[0] * c[0];
+        im[i] = a[0] * s[0];
+        if (i + 1 < n)
+        {
+            re[i + 1] = a[1] * c[1];
+            im[i + 1] = a[1] * s[1];
+        }
+    }
+}
+
 ComplexVector::ComplexVector(ComplexNumber x, ComplexNumber y, ComplexNumber z)
     : x(x), y(y), z(z)
 {
@@ -102,3 +193,36 @@ ComplexVector ComplexVector::operator*(double v)
 {
     return ComplexVector(x * v, y * v, z * v);
 }
+
+PolarField::PolarField()
+    : theta(ComplexNumber(0, 0), ComplexNumber(0, 0), ComplexNumber(0, 0)),
+      phi(ComplexNumber(0, 0), ComplexNumber(0, 0), ComplexNumber(0, 0))
+{
+}
+
+PolarField::PolarField(const ComplexVector &theta, const ComplexVector &phi)
+    : theta(theta), phi(phi)
+{
+}
+
+PolarField PolarField::operator+(const PolarField &v) const
+{
+    return PolarField(
+        ComplexVector(theta.x + v.theta.x, theta.y + v.theta.y, theta.z + v.theta.z),
+        ComplexVector(phi.x + v.phi.x, phi.y + v.phi.y, phi.z + v.phi.z));
+}
+
+PolarField PolarField::operator*(double v) const
+{
+    return PolarField(
+        ComplexVector(theta.x * v, theta.y * v, theta.z * v),
+        ComplexVector(phi.x * v, phi.y * v, phi.z * v));
+}
+
+ComplexVector PolarField::Combine(const ComplexNumber &wTheta, const ComplexNumber &wPhi) const
+{
+    return ComplexVector(
+        theta.x * wTheta + phi.x * wPhi,
+        theta.y * wTheta + phi.y * wPhi,
+        theta.z * wTheta + phi.z * wPhi);
+}
@@ -30,6 +30,9 @@ public:
     // Calculate A * e ^ (i * phi)
     //         = A * cos(phi) * A * i * sin(phi)
     static ComplexNumber Euler(double A, double phi);
+
+    // Calculate A[i] * e ^ (i * phi[i]) for n phases, two at a time with SSE2
+    static void Euler(const double *A, const double *phi, double *re, double *im, int n);
 };
 
 class ComplexVector
@@ -46,4 +49,25 @@ public:
     ComplexVector operator*(double v);
 };
 
+// Fields of one ray (or path) for the two tx polarizations: "theta" is the
+// field of a vertically (theta) polarized tx, "phi" of a horizontally (phi)
+// polarized one. Together they are the polarization transfer (Jones) matrix of
+// the ray in world coordinates, the field of any tx polarization is
+// theta * w_theta + phi * w_phi.
+class PolarField
+{
+public:
+    ComplexVector theta;
+    ComplexVector phi;
+
+public:
+    PolarField(); // zero
+    PolarField(const ComplexVector &theta, const ComplexVector &phi);
+
+    PolarField operator+(const PolarField &v) const;
+    PolarField operator*(double v) const;
+
+    ComplexVector Combine(const ComplexNumber &wTheta, const ComplexNumber &wPhi) const;
+};
+
 #endif
@@ -0,0 +1,303 @@
+#include "EdgeAcc.h"
+#include "Triangle.h"
+#include "Utils.h"
+
+#include <unordered_map>
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+
+// Vertices closer than 0.1 mm are the same vertex
+struct EdgeKey
+{
+    long long v[6]; // quantized coordinates of the two vertices (ordered)
+
+    bool operator==(const EdgeKey &k) const
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            if (v[i] != k.v[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+struct EdgeKeyHash
+{
+    std::size_t operator()(const EdgeKey &key) const
+    {
+        unsigned long long h = 0;
+        for (int i = 0; i < 6; i++)
+        {
+            h = h * 0x9E3779B97F4A7C15ULL + (unsigned long long)key.v[i];
+        }
+        return (std::size_t)(h ^ (h >> 32));
+    }
+};
+
+static EdgeKey make_edge_key(const Point &p, const Point &q)
+{
+    long long a[3], b[3];
+    for (int i = 0; i < 3; i++)
+    {
+        a[i] = (long long)floor(p[i] * 10000.0 + 0.5);
+        b[i] = (long long)floor(q[i] * 10000.0 + 0.5);
+    }
+
+    bool swap = a[0] > b[0] || (a[0] == b[0] && (a[1] > b[1] || (a[1] == b[1] && a[2] > b[2])));
+    EdgeKey key;
+    for (int i = 0; i < 3; i++)
+    {
+        key.v[i] = swap ? b[i] : a[i];
+        key.v[i + 3] = swap ? a[i] : b[i];
+    }
+    return key;
+}
+
+// Unit vector in the face of the triangle, perpendicular to the edge p -> p + e,
+// pointing from the edge to the opposite vertex c
+static Vector face_direction(const Point &p, const Vector &e, const Point &c)
+{
+    Vector v(p, c);
+    Vector d = v - e * v.dot(e);
+    return d.norm();
+}
+
+void EdgeAcc::clear()
+{
+    edges.clear();
+    nodes.clear();
+    order.clear();
+}
+
+void EdgeAcc::build(const std::vector<Geometry *> &scene, double minAngle)
+{
+    clear();
+
+    // 1. Find the triangles of every edge
+    struct Faces
+    {
+        int count;
+        Triangle *t[2];
+        int opposite[2]; // the vertex (0, 1, 2) not on the edge
+    };
+    std::unordered_map<EdgeKey, Faces, EdgeKeyHash> faces;
+
+    for (unsigned int i = 0; i < scene.size(); i++)
+    {
+        if (scene[i]->type != TRIANGLE)
+            continue;
+
+        Triangle *t = (Triangle *)scene[i];
+        const Point *v[3] = { &t->a, &t->b, &t->c };
+        for (int k = 0; k < 3; k++)
+        {
+            EdgeKey key = make_edge_key(*v[k], *v[(k + 1) % 3]);
+            std::unordered_map<EdgeKey, Faces, EdgeKeyHash>::iterator it = faces.find(key);
+            if (it == faces.end())
+            {
+                Faces f;
+                f.count = 1;
+                f.t[0] = t;
+                f.opposite[0] = (k + 2) % 3;
+                faces.insert(std::make_pair(key, f));
+            }
+            else
+            {
+                if (it->second.count < 2)
+                {
+                    it->second.t[1] = t;
+                    it->second.opposite[1] = (k + 2) % 3;
+                }
+                it->second.count += 1;
+            }
+        }
+    }
+
+    // 2. Keep the convex wedges of two triangles
+    std::unordered_map<EdgeKey, Faces, EdgeKeyHash>::iterator it;
+    for (it = faces.begin(); it != faces.end(); ++it)
+    {
+        const Faces &f = it->second;
+        if (f.count != 2)
+            continue;
+
+        const Point *v0[3] = { &f.t[0]->a, &f.t[0]->b, &f.t[0]->c };
+        const Point *v1[3] = { &f.t[1]->a, &f.t[1]->b, &f.t[1]->c };
+        Point a = *v0[(f.opposite[0] + 1) % 3];
+        Point b = *v0[(f.opposite[0] + 2) % 3];
+
+        Edge edge;
+        edge.a = a;
+        edge.b = b;
+        edge.e = Vector(a, b);
+        edge.length = edge.e.length();
+        if (edge.length < 1e-6)
+            continue;
+        edge.e.norm();
+
+        edge.face0 = face_direction(a, edge.e, *v0[f.opposite[0]]);
+        Vector face1 = face_direction(a, edge.e, *v1[f.opposite[1]]);
+
+        // Outside of face 0 (its normal, perpendicular to the edge)
+        Vector n0 = f.t[0]->normal - edge.e * f.t[0]->normal.dot(edge.e);
+        n0 = n0 - edge.face0 * n0.dot(edge.face0);
+        if (n0.length() < 1e-9)
+            continue;
+        edge.normal0 = n0.norm();
+
+        // Angle of face 1, measured from face 0 through the outside
+        double phi1 = atan2(face1.dot(edge.normal0), face1.dot(edge.face0));
+        if (phi1 < 0)
+            phi1 += 2 * PI;
+        edge.n = phi1 / PI;
+        if (edge.n < 1 + minAngle / PI || edge.n > 2 - 1e-6)
+            continue;
+
+        // The normal of face 1 must point to the outside too
+        Vector outside1 = edge.face0 * cos(phi1 - PI / 2) + edge.normal0 * sin(phi1 - PI / 2);
+        if (f.t[1]->normal.dot(outside1) <= 0)
+            continue;
+
+        edge.index = (int)edges.size();
+        edges.push_back(edge);
+    }
+
+    // 3. Bounding volume hierarchy
+    order.resize(edges.size());
+    for (unsigned int i = 0; i < edges.size(); i++)
+    {
+        order[i] = i;
+    }
+    if (!edges.empty())
+        buildNode(0, (int)edges.size());
+
+    Utils::DbgPrint("Diffracting edges: %d (%d nodes)\n", (int)edges.size(), (int)nodes.size());
+}
+
+int EdgeAcc::buildNode(int first, int count)
+{
+    int index = (int)nodes.size();
+    nodes.push_back(Node());
+
+    Point min(DBL_MAX, DBL_MAX, DBL_MAX);
+    Point max(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+    for (int i = first; i < first + count; i++)
+    {
+        const Edge &edge = edges[order[i]];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            min[axis] = std::min(min[axis], std::min(edge.a[axis], edge.b[axis]));
+            max[axis] = std::max(max[axis], std::max(edge.a[axis], edge.b[axis]));
+        }
+    }
+    nodes[index].min = min;
+    nodes[index].max = max;
+    nodes[index].first = first;
+    nodes[index].count = count;
+    nodes[index].left = -1;
+    nodes[index].right = -1;
+    if (count <= LeafEdges)
+        return index;
+
+    // Median split of the edge centers on the longest axis
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+    {
+        if (max[k] - min[k] > max[axis] - min[axis])
+            axis = k;
+    }
+    struct CenterLess
+    {
+        const std::vector<Edge> *edges;
+        int axis;
+        bool operator()(int i, int j) const
+        {
+            return (*edges)[i].a[axis] + (*edges)[i].b[axis] < (*edges)[j].a[axis] + (*edges)[j].b[axis];
+        }
+    } less = { &edges, axis };
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count, less);
+
+    int left = buildNode(first, half);
+    int right = buildNode(first + half, count - half);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+
+// Distance between the segments p1 -> p1 + d1 and p2 -> p2 + d2
+static double segment_distance(const Point &p1, const Vector &d1, const Point &p2, const Vector &d2)
+{
+    Vector r(p2, p1);
+    double a = d1.dot(d1), e = d2.dot(d2);
+    double b = d1.dot(d2), c = d1.dot(r), f = d2.dot(r);
+    double denom = a * e - b * b;
+
+    double s = denom > 1e-12 * a * e ? std::max(0.0, std::min(1.0, (b * f - c * e) / denom)) : 0.0;
+    double t = (b * s + f) / e;
+    if (t < 0)
+    {
+        t = 0;
+        s = std::max(0.0, std::min(1.0, -c / a));
+    }
+    else if (t > 1)
+    {
+        t = 1;
+        s = std::max(0.0, std::min(1.0, (b - c) / a));
+    }
+    return Vector(p2 + d2 * t, p1 + d1 * s).length();
+}
+
+void EdgeAcc::query(const Point &origin, const Vector &direction, double length, double radius,
+    std::vector<int> &found) const
+{
+    found.clear();
+    if (nodes.empty())
+        return;
+
+    Vector segment = direction * length;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const Node &node = nodes[stack[--top]];
+
+        // Segment against the box grown by the radius (slabs)
+        double t0 = 0, t1 = length;
+        for (int axis = 0; axis < 3 && t0 <= t1; axis++)
+        {
+            double lo = node.min[axis] - radius;
+            double hi = node.max[axis] + radius;
+            if (fabs(direction[axis]) < 1e-12)
+            {
+                if (origin[axis] < lo || origin[axis] > hi)
+                    t1 = -1;
+                continue;
+            }
+            double ta = (lo - origin[axis]) / direction[axis];
+            double tb = (hi - origin[axis]) / direction[axis];
+            t0 = std::max(t0, std::min(ta, tb));
+            t1 = std::min(t1, std::max(ta, tb));
+        }
+        if (t0 > t1)
+            continue;
+
+        if (node.left < 0)
+        {
+            for (int i = node.first; i < node.first + node.count; i++)
+            {
+                const Edge &edge = edges[order[i]];
+                if (segment_distance(origin, segment, edge.a, edge.e * edge.length) <= radius)
+                    found.push_back(edge.index);
+            }
+        }
+        else
+        {
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef EDGE_ACC_H
+#define EDGE_ACC_H
+
+#include <vector>
+#include "Geometry.h"
+
+// Diffracting edges of the scene and a bounding volume hierarchy over them
+//
+// An edge is shared by exactly two triangles that are not coplanar and form a
+// convex wedge as seen from the side their normals point to (the outside).
+// Boundary edges (one triangle) and concave wedges are not diffracting edges.
+//
+// Not an Accelerator: rays are not intersected with edges, a query returns the
+// edges passing within a distance of a segment (e.g. the footprint of a ray
+// tube, or the neighborhood of a tx-rx segment).
+class EdgeAcc
+{
+public:
+    struct Edge
+    {
+        Point a;
+        Point b;
+        Vector e;       // unit vector a -> b
+        double length;
+        Vector face0;   // unit vector in face 0, perpendicular to the edge (phi = 0)
+        Vector normal0; // unit normal of face 0, towards the outside (phi = PI / 2)
+        double n;       // exterior angle of the wedge / PI (1 < n <= 2)
+        int index;      // in the edge list
+    };
+
+private:
+    struct Node
+    {
+        Point min;
+        Point max;
+        int left;  // child nodes, -1 for a leaf
+        int right;
+        int first; // edges order[first, first + count) of a leaf
+        int count;
+    };
+
+    std::vector<Edge> edges;
+    std::vector<Node> nodes;
+    std::vector<int> order;
+
+    static const int LeafEdges = 4;
+
+private:
+    int buildNode(int first, int count);
+
+public:
+    // minAngle: the smallest wedge turn (PI - interior angle, radian) of an edge
+    void build(const std::vector<Geometry *> &scene, double minAngle);
+    void clear();
+
+    int size() const { return (int)edges.size(); }
+    const Edge &get(int i) const { return edges[i]; }
+
+    // Edges within "radius" of the segment origin -> origin + direction * length
+    void query(const Point &origin, const Vector &direction, double length, double radius,
+        std::vector<int> &found) const;
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "LinearAcc.h"
 #include "KdTreeAcc.h"
 #include "GridAcc.h"
+#include "HybridAcc.h"
+#include "TerrainAcc.h"
+#include "AccSelector.h"
 
 #include "Triangle.h"
 #include "Sphere.h"
@@ -8,15 +11,45 @@
 #include "Matrix.h"
 #include "Complex.h"
 #include "RxFields.h"
+#include "Checkpoint.h"
+#include "RxSpill.h"
+#include "RayTube.h"
+#include "TxSweep.h"
+#include "RayRecorder.h"
+#include "RxSampling.h"
+#include "EdgeAcc.h"
+#include "MeshSanitizer.h"
 
 #include "Utils.h"
 #include "Engine.h"
 
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
 // Scene
 std::vector<Geometry *> scene;
 
+// Terrain and buildings (kept out of the scene, see TerrainAcc.h)
+std::vector<Geometry *> primitives;
+Buildings *buildings = NULL; // also in primitives
+
 // Preprocessing
 Accelerator *accelerator = NULL;
+bool autoPreprocess = false; // select the accelerator in prepare() (see AccSelector)
+TerrainAcc *terrainAcc = NULL; // wraps the accelerator when there are primitives
+
+// Scene edits, applied in place to the accelerator built by the last prepare()
+std::map<int, std::vector<Geometry *> > triangleGroups; // see AddTriangleGroup()
+int nextGroupId = 1;
+bool acceleratorBuilt = false; // holds the scene except for the edits below
+std::vector<Geometry *> addedObjects;
+std::vector<Geometry *> removedObjects; // deleted after the update
+int sceneGeneration = 0; // changed by every geometry edit, the rx spheres excepted
 
 // Tx pointhy
 Point txPoint;
@@ -27,6 +60,96 @@ std::vector<Point> rxPoints;
 std::vector<RxFields> rxFields;
 double rxRadius;
 
+// Trace method
+RtTraceMethod traceMethod = RaySpheres;
+RxGrid rxGrid; // rx points for ray tubes
+const int maxTubeSplits = 4; // a launched ray tube is split up to 4 times (256 sub tubes)
+int maxTubeLevel = 0;
+
+// Memory limit of rx fields (spilled to disk when exceeded)
+RxSpill rxSpill;
+int memoryLimit = 0; // MB, 0 = unlimited
+int storedPaths = 0; // number of paths held in rxFields
+
+// Incremental tx sweep
+TxSweep txSweep;
+bool sweeping = false; // record the paths for the next SweepTx()
+int currentRegion = 0; // angular region of the ray being traced
+std::vector<Geometry *> currentReflections; // reflections of the ray being traced
+
+// Tx polarization (weights of the theta and phi fields, see PolarField)
+ComplexNumber txPolarTheta(1, 0); // vertical
+ComplexNumber txPolarPhi(0, 0);
+ComplexNumber rxPolarTheta(1, 0); // of the rx array elements
+ComplexNumber rxPolarPhi(0, 0);
+
+// Antenna arrays (element offsets from the tx point / rx points)
+std::vector<Vector> txElements;
+std::vector<Vector> rxElements;
+
+// Stratified jittered launching (shooting and bouncing rays)
+bool launchJitter = false;
+unsigned int launchSeed = 0;
+
+// Materials: ID 0 is the material of SetParameters(), AddMaterial() adds the
+// others. The geometry added after SetMaterial() gets its ID (Geometry::material).
+struct RtMaterial
+{
+    double permittivity;
+    double conductivity;
+};
+std::vector<RtMaterial> materials(1); // [0] is not used, see prepare_materials()
+unsigned short currentMaterial = 0;
+std::vector<ComplexNumber> materialEpsilon; // complex relative permittivity per ID, at the frequency of the simulation
+
+// Wall penetration (see TransmitKernel): every hit splits into a reflected and
+// a transmitted branch, traced strongest first within the budgets
+struct RtTransmission
+{
+    bool enabled;
+    double wallThickness; // m
+    int maxTransmissions; // per path
+    double powerFloor;    // branches carrying less of the launched power are pruned
+    int maxBranches;      // traced branches per launched ray
+
+    // statistics of the last simulation
+    long long rays;
+    long long branches;
+    long long pruned;
+    double prunedPower;   // sum of the pruned fractions of launched power
+} transmission = { false, 0.2, 2, 1e-4, 64, 0, 0, 0, 0 };
+
+// Diffraction (first order, tx -> edge -> rx, see add_diffracted_fields())
+bool diffractionEnabled = false;
+double diffractionRadius = 50; // edges searched around the tx-rx segment (m)
+const double diffractionMinAngle = 10 * PI / 180; // smallest wedge turn of an edge
+EdgeAcc edgeAcc;
+bool edgesBuilt = false; // for the scene of the accelerator
+
+// Sampling diagnostics of the rx spheres
+RxSampling rxSampling;
+bool samplingEnabled = false;
+int samplingMinHits = 2; // wanted hits per path
+RxSampling *sampling = NULL; // &rxSampling while a diagnosed simulation runs
+
+// NUMA placement: the trace thread and the threads building the accelerator
+// are pinned to one node, so that the accelerator is allocated there
+bool numaPlacement = false;
+Utils::ThreadAffinity numaAffinity = { 0, 0 }; // of the trace thread before pinning
+int numaStart = 0; // tick count when the thread was pinned
+long long tracedRays = 0; // launched rays (or tubes) since then
+std::vector<long long> nodeRays; // per node, over all simulations
+std::vector<int> nodeTicks;
+
+// Ray recorder (debugging / visualization)
+RayRecorder rayRecorder;
+std::string rayRecorderFilename; // empty = disabled
+RayRecorder *recorder = NULL; // &rayRecorder while a recording simulation runs
+
+// Checkpoint
+std::string checkpointFilename;
+int checkpointInterval = 0; // seconds, 0 = disabled
+
 // Other parameters
 struct RtParameter
 {
@@ -40,6 +163,8 @@ struct RtParameter
     // automatic
     double lamda;
     double k;
+    double txField;       // amplitude of the tx field at 1 m (V)
+    double powerFactor;   // watt = powerFactor * |E|^2
 } parameters;
 
 void Initialize()
@@ -48,6 +173,43 @@ void Initialize()
     Utils::PrintTime("Initialize");
 
     scene.clear();
+    triangleGroups.clear();
+    acceleratorBuilt = false;
+    addedObjects.clear();
+    for (unsigned int i = 0; i < removedObjects.size(); i++)
+    {
+        delete removedObjects[i];
+    }
+    removedObjects.clear();
+
+    for (unsigned int i = 0; i < primitives.size(); i++)
+    {
+        delete primitives[i];
+    }
+    primitives.clear();
+    buildings = NULL;
+    if (terrainAcc != NULL && accelerator == terrainAcc)
+    {
+        accelerator = terrainAcc->getTriangles();
+    }
+    delete terrainAcc;
+    terrainAcc = NULL;
+
+    sweeping = false;
+    txSweep.Reset();
+
+    materials.resize(1);
+    currentMaterial = 0;
+}
+
+void add_object(Geometry *object)
+{
+    if (object->type != SPHERE)
+        sceneGeneration += 1;
+    object->material = currentMaterial;
+    scene.push_back(object);
+    if (acceleratorBuilt)
+        addedObjects.push_back(object);
 }
 
 void AddTriangle(const RtTriangle &triangle)
@@ -58,7 +220,7 @@ void AddTriangle(const RtTriangle &triangle)
     Vector n = Vector(triangle.n.x, triangle.n.y, triangle.n.z);
 
     Triangle *t = new Triangle(a, b, c, n);
-    scene.push_back(t);
+    add_object(t);
 }
 
 void AddTriangles(const RtTriangle *triangles, int n)
@@ -71,7 +233,65 @@ void AddTriangles(const RtTriangle *triangles, int n)
         Vector n = Vector(triangles[i].n.x, triangles[i].n.y, triangles[i].n.z);
 
         Triangle *t = new Triangle(a, b, c, n);
-        scene.push_back(t);
+        add_object(t);
+    }
+}
+
+// Pipelined STL reading: the calling thread reads chunks of records and the
+// workers decode them into triangles while the next chunks are read. The
+// triangles are numbered in the file order, so the scene does not depend on
+// the number of workers.
+struct StlChunk
+{
+    int first; // record index
+    int count;
+    std::vector<char> records;
+};
+
+struct StlPipeline
+{
+    static const int RecordSize = 50; // normal, 3 vertices (12 floats), attribute (short)
+    static const int ChunkRecords = 16384;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<StlChunk *> chunks;
+    bool done; // no more chunks
+    std::vector<Triangle *> *triangles;
+    int firstIndex; // Geometry::index of the first record
+};
+
+void stl_worker(StlPipeline *pipeline)
+{
+    while (true)
+    {
+        StlChunk *chunk = NULL;
+        {
+            std::unique_lock<std::mutex> guard(pipeline->lock);
+            while (pipeline->chunks.empty() && !pipeline->done)
+            {
+                pipeline->changed.wait(guard);
+            }
+            if (pipeline->chunks.empty())
+                return;
+            chunk = pipeline->chunks.front();
+            pipeline->chunks.pop_front();
+        }
+        pipeline->changed.notify_all(); // room for the reader
+
+        for (int i = 0; i < chunk->count; i++)
+        {
+            float v[12];
+            memcpy(v, &chunk->records[i * StlPipeline::RecordSize], sizeof(v));
+
+            Vector normal = Vector((double)v[0], (double)v[1], (double)v[2]);
+            Point a = Point((double)v[3], (double)v[4], (double)v[5]);
+            Point b = Point((double)v[6], (double)v[7], (double)v[8]);
+            Point c = Point((double)v[9], (double)v[10], (double)v[11]);
+            int k = chunk->first + i;
+            (*pipeline->triangles)[k] = new Triangle(a, b, c, normal, pipeline->firstIndex + k);
+        }
+        delete chunk;
     }
 }
 
@@ -90,49 +310,249 @@ bool AddStlModel(const char *filename)
     int count = -1;
 
     fread(header, 80, 1, fp);
-    fread(&count, sizeof(int), 1, fp);
+    if (fread(&count, sizeof(int), 1, fp) != 1 || count < 0)
+    {
+        fprintf(stderr, "Error: Invalid STL file \"%s\"\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    // The count must fit in the file, before anything is allocated for it
+    long long size = -1;
+    if (_fseeki64(fp, 0, SEEK_END) == 0)
+        size = _ftelli64(fp);
+    if (size < 0 || _fseeki64(fp, 84, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "Error: Cannot read file \"%s\"\n", filename);
+        fclose(fp);
+        return false;
+    }
+    if (size < 84 + (long long)StlPipeline::RecordSize * count)
+    {
+        fprintf(stderr, "Error: Invalid STL file \"%s\" (%d triangles, %lld bytes)\n", filename, count, size);
+        fclose(fp);
+        return false;
+    }
 
     // Read triangles
-    for (int i = 0; i < count; i++)
+    std::vector<Triangle *> triangles(count, (Triangle *)NULL);
+    StlPipeline pipeline;
+    pipeline.done = false;
+    pipeline.triangles = &triangles;
+    pipeline.firstIndex = Geometry::reserveIndexes(count);
+
+    int nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, count / StlPipeline::ChunkRecords + 1);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers.push_back(std::thread(stl_worker, &pipeline));
+    }
+
+    int read = 0;
+    while (read < count)
+    {
+        StlChunk *chunk = new StlChunk();
+        chunk->first = read;
+        chunk->count = std::min(StlPipeline::ChunkRecords, count - read);
+        chunk->records.resize(chunk->count * StlPipeline::RecordSize);
+        int n = (int)fread(&chunk->records[0], StlPipeline::RecordSize, chunk->count, fp);
+        chunk->count = n;
+        read += n;
+
+        std::unique_lock<std::mutex> guard(pipeline.lock);
+        while ((int)pipeline.chunks.size() >= 2 * nThreads) // bounded, the workers are behind
+        {
+            pipeline.changed.wait(guard);
+        }
+        pipeline.chunks.push_back(chunk);
+        guard.unlock();
+        pipeline.changed.notify_all();
+
+        if (n == 0) // truncated
+            break;
+    }
+    fclose(fp);
+
+    {
+        std::lock_guard<std::mutex> guard(pipeline.lock);
+        pipeline.done = true;
+    }
+    pipeline.changed.notify_all();
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers[i].join();
+    }
+
+    if (read < count)
+    {
+        fprintf(stderr, "Error: STL file \"%s\" is truncated (%d of %d triangles)\n", filename, read, count);
+        for (int i = 0; i < read; i++)
+        {
+            delete triangles[i];
+        }
+        return false;
+    }
+
+    // Remove degenerate and duplicate triangles, fix the normals
+    MeshSanitizer::Stats stats;
+    MeshSanitizer::Sanitize(triangles, stats);
+    fprintf(stderr, "    STL model: %d triangles, removed %d degenerate and %d duplicates, fixed %d normals (%d flipped)\n",
+        stats.input, stats.degenerate, stats.duplicates, stats.fixedNormals + stats.flippedNormals, stats.flippedNormals);
+
+    // Add to scene
+    for (unsigned int i = 0; i < triangles.size(); i++)
+    {
+        add_object(triangles[i]);
+    }
+    return true;
+}
+
+bool AddHeightfield(const float *heights, int nx, int ny, double x0, double y0, double cellSize)
+{
+    if (heights == NULL || nx < 2 || ny < 2 || cellSize <= 0)
+    {
+        fprintf(stderr, "Error: Invalid heightfield (%d x %d samples, cell size %.2lf)\n", nx, ny, cellSize);
+        return false;
+    }
+
+    Heightfield *heightfield = new Heightfield(heights, nx, ny, x0, y0, cellSize);
+    heightfield->material = currentMaterial;
+    primitives.push_back(heightfield);
+    sceneGeneration += 1;
+    acceleratorBuilt = false;
+    fprintf(stderr, "    Heightfield: %d x %d samples, cell size %.2lf\n", nx, ny, cellSize);
+    return true;
+}
+
+int AddMaterial(double permittivity, double conductivity)
+{
+    if (materials.size() > 65535)
+    {
+        fprintf(stderr, "Error: Too many materials\n");
+        return -1;
+    }
+
+    RtMaterial material = { permittivity, conductivity };
+    materials.push_back(material);
+    fprintf(stderr, "    Material %d: permittivity %.2lf, conductivity %.5lf\n",
+        (int)materials.size() - 1, permittivity, conductivity);
+    return (int)materials.size() - 1;
+}
+
+bool SetMaterial(int id)
+{
+    if (id < 0 || id >= (int)materials.size())
+    {
+        fprintf(stderr, "Error: Invalid material %d\n", id);
+        return false;
+    }
+    currentMaterial = (unsigned short)id;
+    return true;
+}
+
+bool AddBuilding(const RtPoint *footprint, int n, double height)
+{
+    if (footprint == NULL || n < 3 || !(height > 0))
+    {
+        fprintf(stderr, "Error: Invalid building (%d vertices, height %.2lf)\n", n, height);
+        return false;
+    }
+
+    std::vector<double> x(n), y(n);
+    double base = DBL_MAX;
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = footprint[i].x;
+        y[i] = footprint[i].y;
+        base = std::min(base, footprint[i].z);
+    }
+
+    if (buildings == NULL)
+    {
+        buildings = new Buildings();
+        primitives.push_back(buildings);
+    }
+    acceleratorBuilt = false;
+    sceneGeneration += 1;
+    return buildings->add(&x[0], &y[0], n, base, height, currentMaterial);
+}
+
+int AddTriangleGroup(const RtTriangle *triangles, int n)
+{
+    int id = nextGroupId++;
+    std::vector<Geometry *> &group = triangleGroups[id];
+    for (int i = 0; i < n; i++)
     {
-        float nx, ny, nz;
-        float ax, ay, az;
-        float bx, by, bz;
-        float cx, cy, cz;
-        short attribute;
+        Point a = Point(triangles[i].a.x, triangles[i].a.y, triangles[i].a.z);
+        Point b = Point(triangles[i].b.x, triangles[i].b.y, triangles[i].b.z);
+        Point c = Point(triangles[i].c.x, triangles[i].c.y, triangles[i].c.z);
+        Vector normal = Vector(triangles[i].n.x, triangles[i].n.y, triangles[i].n.z);
+
+        Triangle *t = new Triangle(a, b, c, normal);
+        group.push_back(t);
+        add_object(t);
+    }
 
-        fread(&nx, sizeof(float), 1, fp);
-        fread(&ny, sizeof(float), 1, fp);
-        fread(&nz, sizeof(float), 1, fp);
+    // The recorded paths of the tx sweep may go through the edit
+    sweeping = false;
+    txSweep.Reset();
+    return id;
+}
 
-        fread(&ax, sizeof(float), 1, fp);
-        fread(&ay, sizeof(float), 1, fp);
-        fread(&az, sizeof(float), 1, fp);
+bool RemoveTriangleGroup(int id)
+{
+    std::map<int, std::vector<Geometry *> >::iterator it = triangleGroups.find(id);
+    if (it == triangleGroups.end())
+    {
+        fprintf(stderr, "Error: Unknown triangle group %d\n", id);
+        return false;
+    }
 
-        fread(&bx, sizeof(float), 1, fp);
-        fread(&by, sizeof(float), 1, fp);
-        fread(&bz, sizeof(float), 1, fp);
+    std::unordered_set<Geometry *> group(it->second.begin(), it->second.end());
+    triangleGroups.erase(it);
+    sceneGeneration += 1;
 
-        fread(&cx, sizeof(float), 1, fp);
-        fread(&cy, sizeof(float), 1, fp);
-        fread(&cz, sizeof(float), 1, fp);
-        
-        fread(&attribute, sizeof(short), 1, fp);
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < scene.size(); i++)
+    {
+        if (group.count(scene[i]) == 0)
+            scene[n++] = scene[i];
+    }
+    scene.resize(n);
 
-        Vector normal = Vector((double)nx, (double)ny, (double)nz);
-        Point a = Point((double)ax, (double)ay, (double)az);
-        Point b = Point((double)bx, (double)by, (double)bz);
-        Point c = Point((double)cx, (double)cy, (double)cz);
+    // Objects added since the last preprocessing are not in the accelerator
+    n = 0;
+    for (unsigned int i = 0; i < addedObjects.size(); i++)
+    {
+        if (group.count(addedObjects[i]) == 0)
+            addedObjects[n++] = addedObjects[i];
+        else
+        {
+            group.erase(addedObjects[i]);
+            delete addedObjects[i];
+        }
+    }
+    addedObjects.resize(n);
 
-        // Add to scene
-        scene.push_back(new Triangle(a, b, c, normal));
+    std::unordered_set<Geometry *>::iterator g;
+    for (g = group.begin(); g != group.end(); ++g)
+    {
+        if (acceleratorBuilt)
+            removedObjects.push_back(*g);
+        else
+            delete *g;
     }
 
+    sweeping = false;
+    txSweep.Reset();
     return true;
 }
 
 bool SetPreprocessMethod(RtPreprocessMethod method)
 {
+    autoPreprocess = false;
+    acceleratorBuilt = false;
     if (method == Linear)
     {
         accelerator = new LinearAcc(&scene);
@@ -148,6 +568,16 @@ bool SetPreprocessMethod(RtPreprocessMethod method)
         accelerator = new KdTreeAcc(&scene);
         fprintf(stderr, "    Preprocess method: Kd-tree\n");
     }
+    else if (method == Hybrid)
+    {
+        accelerator = new HybridAcc(&scene);
+        fprintf(stderr, "    Preprocess method: Hybrid\n");
+    }
+    else if (method == Auto)
+    {
+        autoPreprocess = true;
+        fprintf(stderr, "    Preprocess method: Auto\n");
+    }
     else
     {
         fprintf(stderr, "Error: Unknown preprocess method\n");
@@ -177,6 +607,37 @@ void SetRxPoints(const RtPoint *points, int n, double radius)
     fprintf(stderr, "    Rx Sphere Radius = %.2lf\n", radius);
 }
 
+void SetTxPolarization(double tilt, double phase)
+{
+    double t = tilt * PI / 180.0;
+    txPolarTheta = ComplexNumber(cos(t), 0);
+    txPolarPhi = ComplexNumber::Euler(sin(t), phase * PI / 180.0);
+    fprintf(stderr, "    Tx Polarization: tilt %.1lf degrees, phase %.1lf degrees\n", tilt, phase);
+}
+
+void SetRxPolarization(double tilt, double phase)
+{
+    double t = tilt * PI / 180.0;
+    rxPolarTheta = ComplexNumber(cos(t), 0);
+    rxPolarPhi = ComplexNumber::Euler(sin(t), phase * PI / 180.0);
+    fprintf(stderr, "    Rx Polarization: tilt %.1lf degrees, phase %.1lf degrees\n", tilt, phase);
+}
+
+void SetArrays(const RtVector *txOffsets, int nTx, const RtVector *rxOffsets, int nRx)
+{
+    txElements.clear();
+    for (int i = 0; i < nTx; i++)
+    {
+        txElements.push_back(Vector(txOffsets[i].x, txOffsets[i].y, txOffsets[i].z));
+    }
+    rxElements.clear();
+    for (int i = 0; i < nRx; i++)
+    {
+        rxElements.push_back(Vector(rxOffsets[i].x, rxOffsets[i].y, rxOffsets[i].z));
+    }
+    fprintf(stderr, "    Arrays: %d tx elements, %d rx elements\n", nTx, nRx);
+}
+
 void SetParameters(
     double permittivity, double conductivity,  int maxReflections,
     double raySpacing, double frequency)
@@ -195,14 +656,47 @@ void SetParameters(
     fprintf(stderr, "      - Frequency: %.1lf\n", frequency);
 }
 
-void calc_fresnel_coeff(double psi, ComplexNumber &RH, ComplexNumber &RV)
+// Complex relative permittivity of every material at the simulated frequency,
+// so that the reflections only look them up
+void prepare_materials()
 {
-    ComplexNumber epsilon( // complex relative permittivity
-        parameters.permittivity, 
+    materialEpsilon.assign(materials.size(), ComplexNumber(0, 0));
+    materialEpsilon[0] = ComplexNumber(
+        parameters.permittivity,
         -60.0 * parameters.lamda * parameters.conductivity);
-    ComplexNumber eta = (epsilon - cos(psi) * cos(psi)).Sqrt();
-    RH = (epsilon * sin(psi) - eta) / (epsilon * sin(psi) + eta);
-    RV = (ComplexNumber(sin(psi), 0) - eta) / (ComplexNumber(sin(psi), 0) + eta);
+    for (unsigned int i = 1; i < materials.size(); i++)
+    {
+        materialEpsilon[i] = ComplexNumber(
+            materials[i].permittivity,
+            -60.0 * parameters.lamda * materials[i].conductivity);
+    }
+}
+
+void calc_fresnel_coeff(double sinPsi, int material, ComplexNumber &RH, ComplexNumber &RV) // psi: glancing angle
+{
+    const ComplexNumber &epsilon = materialEpsilon[material]; // complex relative permittivity
+    ComplexNumber eta = (epsilon - (1 - sinPsi * sinPsi)).Sqrt(); // cos(psi)^2 = 1 - sin(psi)^2
+    RH = (epsilon * sinPsi - eta) / (epsilon * sinPsi + eta);
+    RV = (ComplexNumber(sinPsi, 0) - eta) / (ComplexNumber(sinPsi, 0) + eta);
+}
+
+// Transmission through a wall (dielectric slab of the wall material and
+// "wallThickness"), ITU-R P.2040: T = (1 - R^2) e^(-j(q - q0)) / (1 - R^2 e^(-j2q))
+void calc_slab_coeff(double sinPsi, int material, ComplexNumber &TH, ComplexNumber &TV) // psi: glancing angle
+{
+    const ComplexNumber &epsilon = materialEpsilon[material];
+    ComplexNumber eta = (epsilon - (1 - sinPsi * sinPsi)).Sqrt();
+    ComplexNumber RH = (epsilon * sinPsi - eta) / (epsilon * sinPsi + eta);
+    ComplexNumber RV = (ComplexNumber(sinPsi, 0) - eta) / (ComplexNumber(sinPsi, 0) + eta);
+
+    ComplexNumber q = eta * (parameters.k * transmission.wallThickness);
+    double q0 = parameters.k * transmission.wallThickness * sinPsi;
+    ComplexNumber e1 = ComplexNumber::Euler(exp(q.b), q0 - q.a); // e^(-j(q - q0))
+    ComplexNumber e2 = ComplexNumber::Euler(exp(2 * q.b), -2 * q.a); // e^(-j2q)
+
+    ComplexNumber one(1, 0);
+    TH = (one - RH * RH) * e1 / (one - RH * RH * e2);
+    TV = (one - RV * RV) * e1 / (one - RV * RV * e2);
 }
 
 void calc_new_base(const Vector &axi, const Vector &axr,
@@ -229,79 +723,117 @@ void calc_new_base(const Vector &dir, Vector &alpha, Vector &beta)
     beta = dir.cross(alpha);
 }
 
-ComplexVector calc_field_direct(Ray &r, double distance)
+// Direct field from the tx point, for both tx polarizations: a vertical dipole
+// (E_theta) and its dual, a small horizontal loop (E_phi), with the same pattern,
+// with the complex field E = E_mag * e^(j * E_phase) already evaluated
+PolarField calc_field_direct(const Ray &r, const ComplexNumber &E)
 {
-    // 20dBm: 0.1 W / 100 mW
-    // 10dBm: 0.01 W / 10 mW
-    //  0dBm: 0.001 W / 1 mW
-    double Pt = pow(10, txPower / 10.0 - 3.0); // Watt
-    double eta0 = 377; // Ohm
-
     Vector phi_v = Vector(0, 0, 1).cross(r.direction);
     Vector theta_v = phi_v.cross(r.direction);
 
-    // suppose vertical polar
-    double E_theta_mag = sqrt(Pt * eta0 / (2 * PI)) / distance;
-    double E_theta_phase = -parameters.k * distance;
-    double E_phi_mag = 0;
-    double E_phi_phase = 0;
+    // complex field vectors
+    return PolarField(E * theta_v, E * phi_v);
+}
+
+PolarField calc_field_direct(Ray &r, double distance)
+{
+    double E_mag = parameters.txField / distance;
+    double E_phase = -parameters.k * distance;
 
     // complex field
-    ComplexNumber E_theta = ComplexNumber::Euler(E_theta_mag, E_theta_phase);
-    ComplexNumber E_phi   = ComplexNumber::Euler(E_phi_mag, E_phi_phase);
+    return calc_field_direct(r, ComplexNumber::Euler(E_mag, E_phase));
+}
+
+// Spreading and phase of the wave of a reflected ray after "distance" from
+// its last reflection: s1 / (s1 + s2) * e^(-j * k * s2)
+ComplexNumber calc_phase(const Ray &r, double distance)
+{
+    if (r.state != Ray::MoreReflect)
+    {
+        fprintf(stderr, "Error: invalid ray state in calc_phase\n");
+        return ComplexNumber(0, 0);
+    }
 
-    // complex field vector
-    ComplexVector Ez = E_theta * theta_v + E_phi * phi_v;
-    return Ez;
+    // spherical wave diffusion factor (Ars2 = s1 / (s1 + s2))
+    double factor = r.prev_mileage / (r.prev_mileage + distance);
+    return ComplexNumber::Euler(factor, -parameters.k * distance);
 }
 
-ComplexVector calc_field_direct(Ray &r, double distance, const ComplexVector &Ei)
+// Phases of a ray segment: the rx spheres it hits and its reflection, evaluated
+// together by the batched ComplexNumber::Euler(). The trace runs on one thread
+// and uses the phases of a segment before it traces the next one, so the
+// buffers are shared.
+struct SegmentPhases
+{
+    std::vector<double> amplitudes;
+    std::vector<double> phases;
+    std::vector<double> re;
+    std::vector<double> im;
+
+    void clear()
+    {
+        amplitudes.clear();
+        phases.clear();
+    }
+
+    // Same as calc_phase(), for a ray in the MoreReflect state
+    void add(const Ray &r, double distance)
+    {
+        amplitudes.push_back(r.prev_mileage / (r.prev_mileage + distance));
+        phases.push_back(-parameters.k * distance);
+    }
+
+    void evaluate()
+    {
+        int n = (int)amplitudes.size();
+        re.resize(n);
+        im.resize(n);
+        if (n > 0)
+            ComplexNumber::Euler(&amplitudes[0], &phases[0], &re[0], &im[0], n);
+    }
+
+    ComplexNumber get(int i) const
+    {
+        return ComplexNumber(re[i], im[i]);
+    }
+} segmentPhases;
+
+// Field of a reflected ray (Ei leaving its last reflection) with the phase of
+// calc_phase() already evaluated
+PolarField calc_field_direct(const Ray &r, const PolarField &Ei, const ComplexNumber &phase)
 {
     // New base
     Vector alpha(0, 0, 0);
     Vector beta(0, 0, 0);
     calc_new_base(r.direction, alpha, beta);
 
-    // h * A = unit * Ei
-    //     A = inv(h) * unit * Ei
+    // h * A = Ei
+    //     A = inv(h) * Ei
     //
     // h:    3x3 matrix (new base)
-    // unit: 3x3 unit matrix
     // A:    input complex field in new coordinate system
-    // Ei:   input complex field
+    // Ei:   input complex field (of each tx polarization)
     Matrix h(
         alpha.x, beta.x, r.direction.x,
         alpha.y, beta.y, r.direction.y,
         alpha.z, beta.z, r.direction.z);
     Matrix inv = h.inverse();
-    Matrix unit(
-        1, 0, 0,
-        0, 1, 0,
-        0, 0, 1);
-    ComplexVector A = inv * (unit * Ei);
-
-    // Reflection field
-    ComplexNumber E_alpha(0, 0);
-    ComplexNumber E_beta(0, 0);
+    ComplexVector A_theta = inv * Ei.theta;
+    ComplexVector A_phi = inv * Ei.phi;
 
-    if (r.state == Ray::MoreReflect)
-    {
-        // spherical wave diffusion factor (Ars2 = s1 / (s1 + s2))
-        double factor = r.prev_mileage / (r.prev_mileage + distance);
-
-        E_alpha = A.x * ComplexNumber::Euler(factor, -parameters.k * distance);
-        E_beta = A.y * ComplexNumber::Euler(factor, -parameters.k * distance);
-    }
-    else
-    {
-        fprintf(stderr, "Error: invalid ray state in calc_field_reflect\n");
-    }
+    return PolarField(
+        (A_theta.x * phase) * alpha + (A_theta.y * phase) * beta,
+        (A_phi.x * phase) * alpha + (A_phi.y * phase) * beta);
+}
 
-    ComplexVector Ez = E_alpha * alpha + E_beta * beta;
-    return Ez;
+PolarField calc_field_direct(Ray &r, double distance, const PolarField &Ei)
+{
+    return calc_field_direct(r, Ei, calc_phase(r, distance));
 }
 
-ComplexVector calc_field_reflect(Ray &r, const IntersectResult &result, const ComplexVector &Ei)
+// The phase of a MoreReflect ray from its last reflection to the hit
+// (calc_phase() of its length) is already evaluated, unused by FirstReflect
+PolarField calc_field_reflect(const Ray &r, const IntersectResult &result, const PolarField &Ei, const ComplexNumber &phase)
 {
     const Vector &n = result.normal; // points to the outside
     Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
@@ -309,13 +841,13 @@ ComplexVector calc_field_reflect(Ray &r, const IntersectResult &result, const Co
     Vector axi = r.direction;
     Vector axr = r.direction - nl * 2 * nl.dot(r.direction);
 
-    // Glancing angle
-    double psi = acos(axi.dot(axr)) / 2.0;
+    // Glancing angle (axi . axr = cos(2 * psi) = 1 - 2 * sin(psi)^2)
+    double sinPsi = std::min(fabs(nl.dot(axi)), 1.0);
 
     // Reflection Coeff
     ComplexNumber RH(0, 0); // horizontal polar
     ComplexNumber RV(0, 0); // vertical polar
-    calc_fresnel_coeff(psi, RH, RV);
+    calc_fresnel_coeff(sinPsi, result.material, RH, RV);
 
     // New base
     Vector alpha1(0, 0, 0);
@@ -324,50 +856,174 @@ ComplexVector calc_field_reflect(Ray &r, const IntersectResult &result, const Co
     Vector beta2(0, 0, 0);
     calc_new_base(axi, axr, alpha1, beta1, alpha2, beta2);
 
-    // h * A = unit * Ei
-    //     A = inv(h) * unit * Ei
+    // h * A = Ei
+    //     A = inv(h) * Ei
     //
     // h:    3x3 matrix (new base)
-    // unit: 3x3 unit matrix
     // A:    input complex field in new coordinate system
-    // Ei:   input complex field
+    // Ei:   input complex field (of each tx polarization)
     Matrix h(
         alpha1.x, beta1.x, axi.x,
         alpha1.y, beta1.y, axi.y,
         alpha1.z, beta1.z, axi.z);
     Matrix inv = h.inverse();
-    Matrix unit(
-        1, 0, 0,
-        0, 1, 0,
-        0, 0, 1);
-    ComplexVector A = inv * (unit * Ei);
-
-    // Reflection field
-    ComplexNumber E_alpha(0, 0);
-    ComplexNumber E_beta(0, 0);
+    ComplexVector A_theta = inv * Ei.theta;
+    ComplexVector A_phi = inv * Ei.phi;
+
+    // Reflection coefficients of the alpha and beta components
+    ComplexNumber C_alpha(0, 0);
+    ComplexNumber C_beta(0, 0);
     if (r.state == Ray::FirstReflect)
     {
-        E_alpha = A.x * RV * 1.0; // the amplitude and the phase remains the same (1.0)
-        E_beta = A.y * RH * 1.0;
+        C_alpha = RV; // the amplitude and the phase remains the same (1.0)
+        C_beta = RH;
     }
     else if (r.state == Ray::MoreReflect)
     {
-        // from previous point to current interseciton point
-        double s2 = Vector(r.prev_point, result.position).length();
+        C_alpha = RV * phase;
+        C_beta = RH * phase;
+    }
+    else
+    {
+        fprintf(stderr, "Error: invalid ray state in calc_field_reflect\n");
+    }
+
+    return PolarField(
+        (A_theta.x * C_alpha) * alpha2 + (A_theta.y * C_beta) * beta2,
+        (A_phi.x * C_alpha) * alpha2 + (A_phi.y * C_beta) * beta2);
+}
+
+PolarField calc_field_reflect(Ray &r, const IntersectResult &result, const PolarField &Ei)
+{
+    if (r.state != Ray::MoreReflect)
+        return calc_field_reflect(r, result, Ei, ComplexNumber(1, 0));
+
+    // from previous point to current interseciton point
+    double s2 = Vector(r.prev_point, result.position).length();
+    return calc_field_reflect(r, result, Ei, calc_phase(r, s2));
+}
+
+// Same as calc_field_reflect(), the ray goes on through the wall
+PolarField calc_field_transmit(Ray &r, const IntersectResult &result, const PolarField &Ei)
+{
+    const Vector &n = result.normal; // points to the outside
+    Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
+
+    Vector axi = r.direction;
+    Vector axr = r.direction - nl * 2 * nl.dot(r.direction); // for the plane of incidence
+    double sinPsi = std::min(fabs(nl.dot(axi)), 1.0);
+
+    ComplexNumber TH(0, 0);
+    ComplexNumber TV(0, 0);
+    calc_slab_coeff(sinPsi, result.material, TH, TV);
+
+    Vector alpha1(0, 0, 0);
+    Vector beta1(0, 0, 0);
+    Vector alpha2(0, 0, 0);
+    Vector beta2(0, 0, 0);
+    calc_new_base(axi, axr, alpha1, beta1, alpha2, beta2);
 
-        // spherical wave diffusion factor (Ars2 = s1 / (s1 + s2))
+    Matrix h(
+        alpha1.x, beta1.x, axi.x,
+        alpha1.y, beta1.y, axi.y,
+        alpha1.z, beta1.z, axi.z);
+    Matrix inv = h.inverse();
+    ComplexVector A_theta = inv * Ei.theta;
+    ComplexVector A_phi = inv * Ei.phi;
+
+    ComplexNumber C_alpha = TV;
+    ComplexNumber C_beta = TH;
+    if (r.state == Ray::MoreReflect)
+    {
+        double s2 = Vector(r.prev_point, result.position).length();
         double factor = r.prev_mileage / (r.prev_mileage + s2);
+        ComplexNumber phase = ComplexNumber::Euler(factor, -parameters.k * s2);
+        C_alpha = TV * phase;
+        C_beta = TH * phase;
+    }
+    else if (r.state != Ray::FirstReflect)
+    {
+        fprintf(stderr, "Error: invalid ray state in calc_field_transmit\n");
+    }
 
-        E_alpha = A.x * RV * ComplexNumber::Euler(factor, -parameters.k * s2);
-        E_beta = A.y * RH * ComplexNumber::Euler(factor, -parameters.k * s2);
+    // the transmitted ray keeps the incident base (alpha1, beta1)
+    return PolarField(
+        (A_theta.x * C_alpha) * alpha1 + (A_theta.y * C_beta) * beta1,
+        (A_phi.x * C_alpha) * alpha1 + (A_phi.y * C_beta) * beta1);
+}
+
+// Relative power of a ray field (|E_theta|^2 + |E_phi|^2, no unit)
+double field_power(const PolarField &E)
+{
+    const ComplexVector *v[2] = { &E.theta, &E.phi };
+    double sum = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        sum += v[i]->x.a * v[i]->x.a + v[i]->x.b * v[i]->x.b +
+               v[i]->y.a * v[i]->y.a + v[i]->y.b * v[i]->y.b +
+               v[i]->z.a * v[i]->z.a + v[i]->z.b * v[i]->z.b;
     }
-    else
+    return sum;
+}
+
+ComplexNumber complex_dot(const ComplexVector &E, const Vector &v)
+{
+    return E.x * v.x + E.y * v.y + E.z * v.z;
+}
+
+// UTD transition function F(X) = 2j sqrt(X) e^(jX) * integral(sqrt(X), inf) e^(-j t^2) dt
+ComplexNumber calc_utd_transition(double X)
+{
+    if (X > 10) // asymptotic
+        return ComplexNumber(1 - 0.75 / (X * X), 0.5 / X);
+
+    // integral(0, u) e^(-j t^2) dt (Simpson)
+    double u = sqrt(X);
+    const int steps = 200;
+    double h = u / steps;
+    ComplexNumber sum(0, 0);
+    for (int i = 0; i <= steps; i++)
     {
-        fprintf(stderr, "Error: invalid ray state in calc_field_reflect\n");
+        double w = (i == 0 || i == steps) ? 1 : (i % 2 == 1 ? 4 : 2);
+        double t = i * h;
+        sum = sum + ComplexNumber::Euler(w, -t * t);
     }
+    ComplexNumber inner = sum * (h / 3);
 
-    ComplexVector Er = E_alpha * alpha2 + E_beta * beta2;
-    return Er;
+    ComplexNumber tail = ComplexNumber::Euler(sqrt(PI) / 2, -PI / 4) - inner;
+    return ComplexNumber::Euler(2 * u, X + PI / 2) * tail;
+}
+
+// One cot(.) F(.) term of the diffraction coefficients
+ComplexNumber calc_utd_term(double n, double sign, double beta, double kL)
+{
+    double x = (PI + sign * beta) / (2 * n);
+    if (fabs(sin(x)) < 1e-6) // shadow or reflection boundary, the product is finite
+        x += 1e-6;
+
+    int N = (int)floor((beta + sign * PI) / (2 * n * PI) + 0.5);
+    double c = cos((2 * n * PI * N - beta) / 2);
+    double a = 2 * c * c;
+
+    return calc_utd_transition(kL * a) * (cos(x) / sin(x));
+}
+
+// UTD diffraction coefficients of a perfectly conducting wedge with the
+// exterior angle n * PI (Kouyoumjian and Pathak), soft (Ds) and hard (Dh)
+void calc_utd_coeff(double n, double phi, double phiInc, double L, double sinBeta0,
+    ComplexNumber &Ds, ComplexNumber &Dh)
+{
+    double k = parameters.k;
+    double kL = k * L;
+    ComplexNumber factor = ComplexNumber::Euler(-1.0 / (2 * n * sqrt(2 * PI * k) * sinBeta0), -PI / 4);
+
+    double bm = phi - phiInc;
+    double bp = phi + phiInc;
+    ComplexNumber incident = calc_utd_term(n, 1, bm, kL) + calc_utd_term(n, -1, bm, kL);
+    ComplexNumber reflected = calc_utd_term(n, 1, bp, kL) + calc_utd_term(n, -1, bp, kL);
+
+    Ds = factor * (incident - reflected);
+    Dh = factor * (incident + reflected);
 }
 
 double calc_power(const ComplexVector &E)
@@ -376,10 +1032,18 @@ double calc_power(const ComplexVector &E)
         E.x.a * E.x.a + E.x.b * E.x.b +
         E.y.a * E.y.a + E.y.b * E.y.b +
         E.z.a * E.z.a + E.z.b * E.z.b;
-    double watt = parameters.lamda * parameters.lamda / (8.0 * PI * 377.0) * norm_sqr;
+    double watt = parameters.powerFactor * norm_sqr;
     return 10 * log10(watt) + 30.0; // dBm
 }
 
+void record_path(int rx, const RayPath &path)
+{
+    if (sweeping)
+    {
+        txSweep.AddPath(rx, currentRegion, path, currentReflections);
+    }
+}
+
 double calc_sphere_area(double theta1, double theta2, double phi1, double phi2)
 {
     // Area = int_theta1_theta2(int_phi1_phi2(r^2 * sin(phi) * d(phi) * d(theta))
@@ -389,20 +1053,60 @@ double calc_sphere_area(double theta1, double theta2, double phi1, double phi2)
     return (theta2 - theta1) * (cos(phi1) - cos(phi2));
 }
 
-void trace(Ray &r, int depth, const ComplexVector &E) // trace with initial field
+// Trace kernels
+//
+// The kernels are specialized on the accelerator type (so that intersect()
+// is bound statically and can be inlined) and on the max number of
+// reflections (0 = read from the parameters at run time). The bounce state is
+// fixed by the entry point: start() traces a ray from the tx point, reflect()
+// traces a reflected ray. select_kernel() picks the instance once per
+// simulation.
+template <class Acc>
+inline IntersectResult intersect_with(Acc *acc, Ray &r, std::vector<RxIntersection> &rxSpheres)
 {
-    std::vector<RxIntersection> rxSpheres;
-    IntersectResult result = accelerator->intersect(r, rxSpheres);
+    return acc->Acc::intersect(r, rxSpheres);
+}
 
-    if (depth > parameters.maxReflections)
-        return;
+template <>
+inline IntersectResult intersect_with<Accelerator>(Accelerator *acc, Ray &r, std::vector<RxIntersection> &rxSpheres)
+{
+    return acc->intersect(r, rxSpheres); // virtual (other accelerators)
+}
 
-    if (!rxSpheres.empty()) // intersect with rx spheres
+template <class Acc, int MaxReflections>
+struct TraceKernel
+{
+    static int maxReflections()
     {
-        for (unsigned int i = 0; i < rxSpheres.size(); i++)
+        return MaxReflections > 0 ? MaxReflections : parameters.maxReflections;
+    }
+
+    // tx -> ... -> r (reflected "depth" times, will reflect again)
+    static void reflect(Acc *acc, Ray &r, int depth, const PolarField &E)
+    {
+        std::vector<RxIntersection> rxSpheres;
+        IntersectResult result = intersect_with(acc, r, rxSpheres);
+        bool reflects = result.hit && depth + 1 <= maxReflections();
+
+        // The phases of the segment at once: the rx spheres, then the hit and
+        // the reflection (see calc_field_direct() and calc_field_reflect())
+        int nRx = (int)rxSpheres.size();
+        segmentPhases.clear();
+        for (int i = 0; i < nRx; i++)
+        {
+            segmentPhases.add(r, rxSpheres[i].distance);
+        }
+        if (reflects)
+        {
+            segmentPhases.add(r, result.distance);
+            segmentPhases.add(r, Vector(r.prev_point, result.position).length());
+        }
+        segmentPhases.evaluate();
+
+        for (int i = 0; i < nRx; i++) // intersect with rx spheres
         {
             // Calculate field
-            ComplexVector Ez = calc_field_direct(r, rxSpheres[i].distance, E);
+            PolarField Ez = calc_field_direct(r, E, segmentPhases.get(i));
 
             // Calculate zoom factor
             double mileage = r.prev_mileage + rxSpheres[i].distance;
@@ -410,169 +1114,1825 @@ void trace(Ray &r, int depth, const ComplexVector &E) // trace with initial fiel
             double rxSphereArea = PI * rxSpheres[i].radius * rxSpheres[i].radius;
             if (projectionArea < rxSphereArea)
                 Ez = Ez * sqrt(projectionArea / rxSphereArea);
+            if (sampling != NULL)
+                sampling->Hit(rxSpheres[i].index, r.path.hash_code, rxSphereArea / projectionArea);
 
             // Add to field list
-            rxFields[rxSpheres[i].index].AddField(Ez, r.path, rxSpheres[i].offset);
+            if (rxFields[rxSpheres[i].index].AddField(Ez, r.path, rxSpheres[i].offset, r.departure, r.direction))
+                storedPaths += 1;
+            record_path(rxSpheres[i].index, r.path);
+            if (recorder != NULL)
+                recorder->Hit(rxSpheres[i].index, r.getPoint(rxSpheres[i].distance), r.path.hash_code);
+        }
+
+        // The reflected ray would not be able to reach any rx point
+        if (!reflects)
+        {
+            if (result.hit && recorder != NULL)
+                recorder->Stop(result.position, r.path.hash_code);
+            return;
+        }
+
+        // Calculate input field
+        PolarField Ei = calc_field_direct(r, E, segmentPhases.get(nRx));
+
+        // Calculate reflection field
+        PolarField Er = calc_field_reflect(r, result, Ei, segmentPhases.get(nRx + 1));
+
+        // Trace recursively
+        Vector n = result.normal; // points to the outside
+        Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
+        Vector v = r.direction - nl * 2 * nl.dot(r.direction);
+
+        Ray newRay(result.position, v, r.unit_surface_area);
+        newRay.state = Ray::MoreReflect; // State is still "MoreReflect"
+        newRay.prev_point = result.position;
+        newRay.prev_mileage = r.prev_mileage + result.distance;
+        newRay.departure = r.departure;
+        newRay.path = r.path;
+        newRay.path.addPoint(result.facet);
+
+        if (recorder != NULL)
+            recorder->Push(result.position, r.path.hash_code);
+        currentReflections.push_back(result.geometry);
+        reflect(acc, newRay, depth + 1, Er);
+        currentReflections.pop_back();
+        if (recorder != NULL)
+            recorder->Pop();
+    }
+
+    // tx -> triangle (will reflect)
+    static void start(Accelerator *accelerator, Ray &r)
+    {
+        Acc *acc = static_cast<Acc *>(accelerator);
+
+        // The rx spheres hit before the first reflection are ignored,
+        // the direct fields are added by add_direct_fields()
+        std::vector<RxIntersection> rxSpheres;
+        IntersectResult result = intersect_with(acc, r, rxSpheres);
+
+        if (!result.hit) // out of the scene
+            return;
+
+        if (recorder != NULL)
+        {
+            recorder->BeginRay(r.origin, r.direction);
+            if (maxReflections() < 1)
+                recorder->Stop(result.position, r.path.hash_code);
+        }
+        if (maxReflections() < 1)
+            return;
+
+        // Calculate input field
+        PolarField Ei = calc_field_direct(r, result.distance);
+
+        // Update state
+        r.state = Ray::FirstReflect;
+
+        // Calculate reflection field
+        PolarField Er = calc_field_reflect(r, result, Ei);
+
+        // Trace recursively
+        Vector n = result.normal; // points to the outside
+        Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
+        Vector v = r.direction - nl * 2 * nl.dot(r.direction);
+
+        Ray newRay(result.position, v, r.unit_surface_area);
+        newRay.state = Ray::MoreReflect; // Update state
+        newRay.prev_point = result.position;
+        newRay.prev_mileage = Vector(r.origin, result.position).length();
+        newRay.departure = r.direction;
+        newRay.path = r.path;
+        newRay.path.addPoint(result.facet);
+
+        if (recorder != NULL)
+            recorder->Push(result.position, r.path.hash_code);
+        currentReflections.push_back(result.geometry);
+        reflect(acc, newRay, 1, Er);
+        currentReflections.pop_back();
+        if (recorder != NULL)
+            recorder->Pop();
+    }
+};
+
+// Trace kernel with wall penetration
+//
+// Every hit splits the ray into a reflected and a transmitted branch, so the
+// ray tree grows as 2^depth. The branches are traced strongest first (gain:
+// the fraction of the launched power the branch still carries after its
+// reflection and transmission losses). A branch below transmission.powerFloor
+// is pruned, and the tree of a launched ray stops after
+// transmission.maxBranches branches (the weakest are left). Both are counted
+// with the pruned power, see stop_transmission().
+//
+// The recorder and the tx sweep are not supported by this kernel.
+template <class Acc>
+struct TransmitKernel
+{
+    struct Branch
+    {
+        Ray ray;
+        PolarField E;      // field leaving ray.origin
+        int reflections;
+        int transmissions;
+        double gain;
+
+        Branch(const Ray &ray, const PolarField &E, int reflections, int transmissions, double gain)
+            : ray(ray), E(E), reflections(reflections), transmissions(transmissions), gain(gain)
+        {
+        }
+    };
+
+    struct Weaker
+    {
+        bool operator()(const Branch &a, const Branch &b) const
+        {
+            return a.gain < b.gain;
+        }
+    };
+
+    static void add_rx_fields(Ray &r, std::vector<RxIntersection> &rxSpheres, const PolarField &E)
+    {
+        segmentPhases.clear();
+        for (unsigned int i = 0; i < rxSpheres.size(); i++)
+        {
+            segmentPhases.add(r, rxSpheres[i].distance);
+        }
+        segmentPhases.evaluate();
+
+        for (unsigned int i = 0; i < rxSpheres.size(); i++) // same as TraceKernel::reflect()
+        {
+            PolarField Ez = calc_field_direct(r, E, segmentPhases.get(i));
+
+            double mileage = r.prev_mileage + rxSpheres[i].distance;
+            double projectionArea = r.unit_surface_area * mileage * mileage;
+            double rxSphereArea = PI * rxSpheres[i].radius * rxSpheres[i].radius;
+            if (projectionArea < rxSphereArea)
+                Ez = Ez * sqrt(projectionArea / rxSphereArea);
+            if (sampling != NULL)
+                sampling->Hit(rxSpheres[i].index, r.path.hash_code, rxSphereArea / projectionArea);
+
+            if (rxFields[rxSpheres[i].index].AddField(Ez, r.path, rxSpheres[i].offset, r.departure, r.direction))
+                storedPaths += 1;
         }
     }
 
-    if (result.hit) // intersect with triangle
+    // Split the branch at its hit into the reflected and the transmitted branch
+    static void split(std::vector<Branch> &heap, Branch &branch, const IntersectResult &result, const PolarField &Ei)
     {
-        if (r.state == Ray::MoreReflect) // tx -> r -> triangle (will reflect again)
+        Ray &r = branch.ray;
+        double incident = field_power(Ei);
+        if (r.state == Ray::MoreReflect) // the coefficients include the spreading (see calc_field_reflect())
         {
-            // Calculate input field
-            ComplexVector Ei = calc_field_direct(r, result.distance, E);
+            double factor = r.prev_mileage / (r.prev_mileage + result.distance);
+            incident *= factor * factor;
+        }
+        if (incident <= 0)
+            return;
 
-            // Calculate reflection field
-            ComplexVector Er = calc_field_reflect(r, result, Ei);
+        Vector n = result.normal; // points to the outside
+        Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
 
-            // Trace recursively
-            Vector n = result.normal; // points to the outside
-            Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
-            Vector v = r.direction - nl * 2 * nl.dot(r.direction);
+        for (int k = 0; k < 2; k++)
+        {
+            bool transmit = (k == 1);
+            if (transmit && branch.transmissions >= transmission.maxTransmissions)
+                continue;
+            if (!transmit && branch.reflections >= parameters.maxReflections)
+                continue;
+
+            PolarField E = transmit ? calc_field_transmit(r, result, Ei) : calc_field_reflect(r, result, Ei);
+            double gain = branch.gain * field_power(E) / incident;
+            if (gain < transmission.powerFloor)
+            {
+                transmission.pruned += 1;
+                transmission.prunedPower += gain;
+                continue;
+            }
 
+            Vector v = transmit ? r.direction : r.direction - nl * 2 * nl.dot(r.direction);
             Ray newRay(result.position, v, r.unit_surface_area);
-            newRay.state = Ray::MoreReflect; // State is still "MoreReflect"
+            newRay.state = Ray::MoreReflect;
             newRay.prev_point = result.position;
             newRay.prev_mileage = r.prev_mileage + result.distance;
-            newRay.path.addPoint(result.geometry->index);
+            newRay.departure = r.departure;
+            newRay.path = r.path;
+            newRay.path.addPoint(transmit ? RayPath::transmission(result.facet) : result.facet); // a transmission is a different path
 
-            trace(newRay, depth + 1, Er);
+            heap.push_back(Branch(newRay, E,
+                branch.reflections + (transmit ? 0 : 1), branch.transmissions + (transmit ? 1 : 0), gain));
+            std::push_heap(heap.begin(), heap.end(), Weaker());
         }
-        else
+    }
+
+    // tx -> triangle (will reflect and transmit)
+    static void start(Accelerator *accelerator, Ray &r)
+    {
+        Acc *acc = static_cast<Acc *>(accelerator);
+        transmission.rays += 1;
+
+        // The rx spheres hit before the first interaction are ignored,
+        // the direct fields are added by add_direct_fields()
+        std::vector<RxIntersection> rxSpheres;
+        IntersectResult result = intersect_with(acc, r, rxSpheres);
+        transmission.branches += 1;
+        if (!result.hit)
+            return;
+
+        PolarField Ei = calc_field_direct(r, result.distance);
+        r.state = Ray::FirstReflect;
+
+        std::vector<Branch> heap;
+        Branch first(r, Ei, 0, 0, 1.0);
+        split(heap, first, result, Ei);
+
+        int traced = 1;
+        while (!heap.empty())
         {
-            fprintf(stderr, "Error: invalid ray state in trace(r, depth, E)\n");
+            std::pop_heap(heap.begin(), heap.end(), Weaker());
+            Branch branch = heap.back();
+            heap.pop_back();
+
+            if (traced >= transmission.maxBranches) // budget spent, drop the rest
+            {
+                transmission.pruned += 1;
+                transmission.prunedPower += branch.gain;
+                continue;
+            }
+            traced += 1;
+            transmission.branches += 1;
+
+            rxSpheres.clear();
+            result = intersect_with(acc, branch.ray, rxSpheres);
+            add_rx_fields(branch.ray, rxSpheres, branch.E);
+            if (!result.hit)
+                continue;
+
+            Ei = calc_field_direct(branch.ray, result.distance, branch.E);
+            split(heap, branch, result, Ei);
         }
     }
-    else
+};
+
+typedef void (*TraceFunction)(Accelerator *accelerator, Ray &r);
+TraceFunction traceKernel = NULL; // selected by select_kernel()
+
+template <class Acc>
+TraceFunction select_kernel_depth()
+{
+    switch (parameters.maxReflections)
+    {
+    case 1: return &TraceKernel<Acc, 1>::start;
+    case 2: return &TraceKernel<Acc, 2>::start;
+    case 3: return &TraceKernel<Acc, 3>::start;
+    case 4: return &TraceKernel<Acc, 4>::start;
+    case 5: return &TraceKernel<Acc, 5>::start;
+    case 6: return &TraceKernel<Acc, 6>::start;
+    default: return &TraceKernel<Acc, 0>::start;
+    }
+}
+
+void select_kernel()
+{
+    if (transmission.enabled)
     {
+        if (dynamic_cast<KdTreeAcc *>(accelerator) != NULL)
+            traceKernel = &TransmitKernel<KdTreeAcc>::start;
+        else if (dynamic_cast<GridAcc *>(accelerator) != NULL)
+            traceKernel = &TransmitKernel<GridAcc>::start;
+        else if (dynamic_cast<HybridAcc *>(accelerator) != NULL)
+            traceKernel = &TransmitKernel<HybridAcc>::start;
+        else
+            traceKernel = &TransmitKernel<Accelerator>::start;
         return;
     }
+
+    if (dynamic_cast<KdTreeAcc *>(accelerator) != NULL)
+        traceKernel = select_kernel_depth<KdTreeAcc>();
+    else if (dynamic_cast<GridAcc *>(accelerator) != NULL)
+        traceKernel = select_kernel_depth<GridAcc>();
+    else if (dynamic_cast<HybridAcc *>(accelerator) != NULL)
+        traceKernel = select_kernel_depth<HybridAcc>();
+    else if (dynamic_cast<LinearAcc *>(accelerator) != NULL)
+        traceKernel = select_kernel_depth<LinearAcc>();
+    else
+        traceKernel = select_kernel_depth<Accelerator>();
 }
 
-void trace(Ray &r, int depth)
+// A reflection of a ray tube
+struct TubeReflection
 {
-    std::vector<RxIntersection> rxSpheres;
-    IntersectResult result = accelerator->intersect(r, rxSpheres);
+    Point point;        // a point on the plane
+    Vector normal;      // points to the outside
+    Geometry *geometry;
+    int facet;          // Geometry::index of the facet
+    int material;
+    Point source;       // image source after the reflection
+};
+
+// Unfold the path backwards: x -> image source n -> ... -> image source 1 -> tx
+void unfold_path(const std::vector<TubeReflection> &reflections, const Point &x, std::vector<Point> &points)
+{
+    int n = (int)reflections.size();
+
+    points.resize(n + 2);
+    points[0] = txPoint;
+    points[n + 1] = x;
+    for (int i = n; i >= 1; i--)
+    {
+        const TubeReflection &f = reflections[i - 1];
+        Vector d = Vector(points[i + 1], f.source).norm();
+        double t = Vector(points[i + 1], f.point).dot(f.normal) / d.dot(f.normal);
+        points[i] = points[i + 1] + d * t;
+    }
+}
+
+// Evaluate the field along an unfolded path, in the same way as trace()
+PolarField calc_field_path(const std::vector<TubeReflection> &reflections, const std::vector<Point> &points)
+{
+    int n = (int)reflections.size();
+
+    Ray r(txPoint, Vector(points[0], points[1]).norm(), 0);
+    if (n == 0) // tx -> rx (direct)
+    {
+        return calc_field_direct(r, Vector(points[0], points[1]).length());
+    }
+
+    PolarField E;
+    for (int i = 1; i <= n; i++)
+    {
+        IntersectResult result(true);
+        result.geometry = reflections[i - 1].geometry;
+        result.distance = Vector(points[i - 1], points[i]).length();
+        result.position = points[i];
+        result.normal = reflections[i - 1].normal;
+        result.material = reflections[i - 1].material;
+
+        PolarField Ei = (i == 1) ? 
+            calc_field_direct(r, result.distance) :
+            calc_field_direct(r, result.distance, E);
+        if (i == 1)
+            r.state = Ray::FirstReflect;
+        E = calc_field_reflect(r, result, Ei);
+
+        double mileage = r.prev_mileage + result.distance;
+        r = Ray(points[i], Vector(points[i], points[i + 1]).norm(), 0);
+        r.state = Ray::MoreReflect;
+        r.prev_point = points[i];
+        r.prev_mileage = mileage;
+    }
+    return calc_field_direct(r, Vector(points[n], points[n + 1]).length(), E);
+}
+
+// Departure direction at the tx point and arrival direction at the rx point
+// of an unfolded path
+void path_directions(const std::vector<Point> &points, Vector &departure, Vector &arrival)
+{
+    int n = (int)points.size() - 1;
+    departure = Vector(points[0], points[1]).norm();
+    arrival = Vector(points[n - 1], points[n]).norm();
+}
+
+// Is the unfolded path still a valid path? (the reflection points are on their
+// triangles and no segment is blocked)
+bool check_path(const std::vector<TubeReflection> &reflections, const std::vector<Point> &points)
+{
+    int n = (int)reflections.size();
 
-    if (!rxSpheres.empty()) // intersect with rx spheres
+    for (int i = 0; i <= n; i++)
     {
-        if (r.state == Ray::Start) // tx -> rx sphere (direct)
+        Vector d(points[i], points[i + 1]);
+        double length = d.length();
+        if (!(length > 1e-9 && length < DBL_MAX)) // degenerated (or NaN)
+            return false;
+
+        std::vector<RxIntersection> rxSpheres;
+        Ray ray(points[i], d.norm(), 0);
+        IntersectResult result = accelerator->intersect(ray, rxSpheres);
+
+        if (i == n) // last segment: nothing between the path and the rx point
         {
-            for (unsigned int i = 0; i < rxSpheres.size(); i++)
-            {
-                // Calculate field
-                ComplexVector Ez = calc_field_direct(r, rxSpheres[i].distance);
+            return !(result.hit && result.distance < length);
+        }
+
+        // The first hit must be the next reflection (or a triangle on the same
+        // plane, as the tracing does not tell them apart either), and the
+        // path must leave on the same side of the plane as it arrives
+        const TubeReflection &f = reflections[i];
+        if (!result.hit || fabs(result.distance - length) > 1e-6 * length + 1e-6)
+            return false;
+        Vector hitNormal = result.normal;
+        Vector facetNormal = f.normal;
+        if (result.geometry != f.geometry &&
+            fabs(hitNormal.norm().dot(facetNormal.norm())) < 1 - 1e-6)
+            return false;
+        if (Vector(f.point, points[i]).dot(f.normal) * Vector(f.point, points[i + 2]).dot(f.normal) <= 0)
+            return false;
+    }
+    return true;
+}
+
+void trace_tube(const RayTube &tube, int depth, std::vector<TubeReflection> &reflections, const RayPath &path)
+{
+    // Cast the central ray and the edge rays
+    Vector dirs[4] = { tube.center(), tube.edges[0], tube.edges[1], tube.edges[2] };
+    IntersectResult results[4];
+    int hits = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<RxIntersection> rxSpheres; // always empty (no rx spheres in the scene)
+        Ray ray(tube.origin(dirs[i]), dirs[i], 0);
+        results[i] = accelerator->intersect(ray, rxSpheres);
+        if (results[i].hit)
+            hits += 1;
+    }
 
-                // Add to field list
-                rxFields[rxSpheres[i].index].AddField(Ez, r.path, rxSpheres[i].offset);
+    // Do all the rays hit the same plane?
+    bool coherent = (hits == 0);
+    if (hits == 4)
+    {
+        coherent = true;
+        const Vector &n = results[0].normal;
+        for (int i = 1; i < 4; i++)
+        {
+            if (fabs(n.dot(results[i].normal)) < 1 - 1e-6 ||
+                fabs(Vector(results[0].position, results[i].position).dot(n)) > 1e-3)
+            {
+                coherent = false;
             }
         }
     }
 
-    if (result.hit) // intersect with triangle
+    if (!coherent && tube.level < maxTubeLevel) // split the tube and try again
     {
-        if (r.state == Ray::Start) // tx -> triangle (will reflect)
+        RayTube sub[4];
+        tube.split(sub);
+        for (int i = 0; i < 4; i++)
         {
-            // Calculate input field
-            ComplexVector Ei = calc_field_direct(r, result.distance);
+            trace_tube(sub[i], depth, reflections, path);
+        }
+        return;
+    }
 
-            // Update state
-            r.state = Ray::FirstReflect;
+    // Use the central ray when the tube cannot be split any more
+    bool hit = results[0].hit;
+    Vector nl(0, 0, 0);
+    if (hit)
+    {
+        const Vector &n = results[0].normal; // points to the outside
+        nl = (n.dot(dirs[0]) < 0) ? n : n * -1; // points to the ray
+    }
+
+    // Find the rx points in the tube (between the entry plane and the exit plane)
+    Point boxMin(DBL_MAX, DBL_MAX, DBL_MAX);
+    Point boxMax(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+    double far = 0;
+    if (!hit) // the tube is not closed, use the rx points to find its end
+    {
+        Point rxMin, rxMax;
+        rxGrid.getBounds(rxMin, rxMax);
+        for (int i = 0; i < 8; i++)
+        {
+            Point corner((i & 1) ? rxMax.x : rxMin.x, (i & 2) ? rxMax.y : rxMin.y, (i & 4) ? rxMax.z : rxMin.z);
+            far = std::max(far, Vector(tube.source, corner).length() * 2); // the end must cover the spherical cap
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        Point p1 = tube.origin(tube.edges[i]);
+        Point p2 = hit ? 
+            tube.source + tube.edges[i] * (Vector(tube.source, results[0].position).dot(nl) / tube.edges[i].dot(nl)) :
+            tube.source + tube.edges[i] * far;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            boxMin[axis] = std::min(boxMin[axis], std::min(p1[axis], p2[axis]));
+            boxMax[axis] = std::max(boxMax[axis], std::max(p1[axis], p2[axis]));
+        }
+    }
 
-            // Calculate reflection field
-            ComplexVector Er = calc_field_reflect(r, result, Ei);
+    if (depth > 0 && depth <= parameters.maxReflections) // direct fields are added by add_direct_fields()
+    {
+        std::vector<int> candidates;
+        rxGrid.query(boxMin, boxMax, candidates);
+
+        for (unsigned int i = 0; i < candidates.size(); i++)
+        {
+            const Point &x = rxPoints[candidates[i]];
+            if (!tube.contains(x))
+                continue;
+            if (hit && Vector(results[0].position, x).dot(nl) < 0) // behind the exit plane
+                continue;
+
+            // Each rx point is in exactly one tube of a path, no offset is needed
+            std::vector<Point> points;
+            Vector departure, arrival;
+            unfold_path(reflections, x, points);
+            path_directions(points, departure, arrival);
+            PolarField Ez = calc_field_path(reflections, points);
+            if (rxFields[candidates[i]].AddField(Ez, path, 0, departure, arrival))
+                storedPaths += 1;
+            record_path(candidates[i], path);
+            if (recorder != NULL)
+                recorder->RecordPath(candidates[i], points, path.hash_code);
+        }
+    }
 
-            // Trace recursively
-            Vector n = result.normal; // points to the outside
-            Vector nl = (n.dot(r.direction) < 0) ? n : n * -1; // points to the ray
-            Vector v = r.direction - nl * 2 * nl.dot(r.direction);
+    if (!hit || depth + 1 > parameters.maxReflections)
+        return;
 
-            Ray newRay(result.position, v, r.unit_surface_area);
-            newRay.state = Ray::MoreReflect; // Update state
-            newRay.prev_point = result.position;
-            newRay.prev_mileage = Vector(r.origin, result.position).length();
-            newRay.path.addPoint(result.geometry->index);
+    // Reflect the tube
+    RayTube newTube = tube;
+    newTube.reflect(results[0].position, nl);
+
+    TubeReflection reflection;
+    reflection.point = results[0].position;
+    reflection.normal = results[0].normal;
+    reflection.geometry = results[0].geometry;
+    reflection.facet = results[0].facet;
+    reflection.material = results[0].material;
+    reflection.source = newTube.source;
+
+    RayPath newPath = path;
+    newPath.addPoint(results[0].facet);
+
+    reflections.push_back(reflection);
+    currentReflections.push_back(reflection.geometry);
+    trace_tube(newTube, depth + 1, reflections, newPath);
+    currentReflections.pop_back();
+    reflections.pop_back();
+}
 
-            trace(newRay, depth + 1, Er);
+// Size of the launch loop
+//  - Ray spheres: nColumns = theta steps, nRows = phi steps
+//  - Ray tubes: nColumns = faces of the subdivided icosahedron, nRows = tubes per face
+void get_launch_size(int &nColumns, int &nRows)
+{
+    if (traceMethod == RayTubes)
+    {
+        // The edge of a tube is about 63.4 / 2^level degrees
+        int level = 0;
+        while (63.4 / (1 << level) > parameters.raySpacing && level < 12)
+        {
+            level += 1;
         }
+        int faceLevel = std::min(level, 2);
+        nColumns = RayTube::FaceCount(faceLevel);
+        nRows = RayTube::FaceCount(level) / nColumns;
     }
     else
     {
-        return; // out of the scene
+        // Generate rays
+        // example: ray spacing = 60 degree
+        //        0     60    120   180   240   300
+        // theta: o-----o-----o-----o-----o-----o-----x
+        //           30    90    150
+        // phi:   ---o-----o-----o---
+        nColumns = (int)(360.0 / parameters.raySpacing + 0.5);
+        nRows = (int)(180.0 / parameters.raySpacing + 0.5);
     }
 }
 
-bool Simulate() 
+// FNV-1a over the material constants of AddMaterial()
+unsigned int material_hash()
+{
+    unsigned int hash = Geometry::hashSeed;
+    for (unsigned int i = 1; i < materials.size(); i++)
+    {
+        hash = Geometry::hashBytes(hash, &materials[i], sizeof(RtMaterial));
+    }
+    return hash;
+}
+
+unsigned int rx_hash()
 {
-    // Add rx spheres (to scene)
+    unsigned int hash = Geometry::hashSeed;
     for (unsigned int i = 0; i < rxPoints.size(); i++)
     {
-        scene.push_back(new RxSphere(rxPoints[i], rxRadius, i));
+        double xyz[3] = { rxPoints[i].x, rxPoints[i].y, rxPoints[i].z };
+        hash = Geometry::hashBytes(hash, xyz, sizeof(xyz));
+    }
+    return hash;
+}
+
+CheckpointHeader make_checkpoint_header(int nColumns, int nRows, int nextColumn)
+{
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    header.traceMethod = (int)traceMethod;
+    header.nColumns = nColumns;
+    header.nRows = nRows;
+    header.nRx = (int)rxPoints.size();
+    header.maxReflections = parameters.maxReflections;
+    header.raySpacing = parameters.raySpacing;
+    header.frequency = parameters.frequency;
+    header.permittivity = parameters.permittivity;
+    header.conductivity = parameters.conductivity;
+    header.txPower = txPower;
+    header.txPoint[0] = txPoint.x;
+    header.txPoint[1] = txPoint.y;
+    header.txPoint[2] = txPoint.z;
+    header.rxRadius = rxRadius;
+    header.launchJitter = launchJitter ? 1 : 0;
+    header.launchSeed = launchSeed;
+    header.diffraction = diffractionEnabled ? 1 : 0;
+    header.diffractionRadius = diffractionEnabled ? diffractionRadius : 0;
+    header.transmission = transmission.enabled ? 1 : 0;
+    header.wallThickness = transmission.enabled ? transmission.wallThickness : 0;
+    header.maxTransmissions = transmission.enabled ? transmission.maxTransmissions : 0;
+    header.powerFloor = transmission.enabled ? transmission.powerFloor : 0;
+    header.maxBranches = transmission.enabled ? transmission.maxBranches : 0;
+    header.nMaterials = (int)materials.size() - 1;
+    header.materialHash = material_hash();
+    header.sceneHash = Geometry::hashSeed;
+    for (unsigned int i = 0; i < scene.size(); i++)
+    {
+        if (scene[i]->type != SPHERE)
+            header.sceneHash = scene[i]->hash(header.sceneHash);
+    }
+    for (unsigned int i = 0; i < primitives.size(); i++)
+    {
+        header.sceneHash = primitives[i]->hash(header.sceneHash);
+    }
+    header.rxHash = rx_hash();
+    header.nextColumn = nextColumn;
+    header.spillRuns = rxSpill.RunCount();
+    return header;
+}
+
+// Everything the paths recorded for SweepTx() depend on besides the tx point.
+// The parameters feed prepare(), which a sweep step does not run again.
+TxSweep::Settings sweep_settings(int nColumns, int nRows)
+{
+    TxSweep::Settings settings;
+    settings.nColumns = nColumns;
+    settings.nRows = nRows;
+    settings.nRx = (int)rxPoints.size();
+    settings.sceneGeneration = sceneGeneration;
+    settings.rxHash = rx_hash();
+
+    double values[] = {
+        (double)traceMethod, (double)parameters.maxReflections, parameters.raySpacing,
+        parameters.frequency, parameters.permittivity, parameters.conductivity,
+        txPower, rxRadius, launchJitter ? (double)launchSeed : -1.0,
+        diffractionEnabled ? diffractionRadius : -1.0
+    };
+    settings.parameterHash = Geometry::hashBytes(material_hash(), values, sizeof(values));
+    return settings;
+}
+
+// Are the rx spheres in the scene those of the current rx points?
+bool same_rx_spheres()
+{
+    unsigned int nSpheres = 0;
+    for (unsigned int i = 0; i < scene.size(); i++)
+    {
+        if (scene[i]->type != SPHERE)
+            continue;
+
+        RxSphere *s = (RxSphere *)scene[i];
+        if (traceMethod != RaySpheres ||
+            s->index < 0 || s->index >= (int)rxPoints.size() || s->radius != rxRadius ||
+            s->center.x != rxPoints[s->index].x ||
+            s->center.y != rxPoints[s->index].y ||
+            s->center.z != rxPoints[s->index].z)
+            return false;
+        nSpheres += 1;
+    }
+    return nSpheres == (traceMethod == RaySpheres ? rxPoints.size() : 0);
+}
+
+void prepare()
+{
+    if (!same_rx_spheres())
+    {
+        // Remove the rx spheres of the previous simulation (rebuilds the
+        // accelerator, the edits only cover the triangle groups)
+        unsigned int nTriangles = 0;
+        for (unsigned int i = 0; i < scene.size(); i++)
+        {
+            if (scene[i]->type == SPHERE)
+                delete scene[i];
+            else
+                scene[nTriangles++] = scene[i];
+        }
+        scene.resize(nTriangles);
+        acceleratorBuilt = false;
 
-        // Initialize containers for fields
-        rxFields.push_back(RxFields());
+        // Add rx spheres (to scene), ray tubes find the rx points by themselves
+        if (traceMethod == RaySpheres)
+        {
+            for (unsigned int i = 0; i < rxPoints.size(); i++)
+            {
+                add_object(new RxSphere(rxPoints[i], rxRadius, i));
+            }
+        }
+    }
+
+    // Initialize containers for fields
+    rxFields.clear();
+    rxFields.resize(rxPoints.size());
+    storedPaths = 0;
+
+    if (traceMethod == RayTubes)
+    {
+        rxGrid.init(rxPoints);
     }
 
     // Calculate automatic parameters
     parameters.lamda = 299792458.0 / (parameters.frequency * 1000000.0); // lamda = c / f
     parameters.k = 2 * PI / parameters.lamda;
+    prepare_materials();
+
+    // 20dBm: 0.1 W / 100 mW
+    // 10dBm: 0.01 W / 10 mW
+    //  0dBm: 0.001 W / 1 mW
+    double Pt = pow(10, txPower / 10.0 - 3.0); // Watt
+    double eta0 = 377; // Ohm
+    parameters.txField = sqrt(Pt * eta0 / (2 * PI));
+    parameters.powerFactor = parameters.lamda * parameters.lamda / (8.0 * PI * eta0);
 
     // Preprocess
     Utils::PrintTime("Preprocessing started");
-    accelerator->init();
+    bool initialized = false;
+    bool sceneChanged = !acceleratorBuilt || !addedObjects.empty() || !removedObjects.empty();
+    if (acceleratorBuilt)
+    {
+        // Update the structure of the last simulation with the scene edits
+        initialized = accelerator->update(addedObjects, removedObjects);
+        if (initialized)
+        {
+            fprintf(stderr, "    Accelerator updated: %d objects added, %d removed\n",
+                (int)addedObjects.size(), (int)removedObjects.size());
+        }
+    }
+    if (!initialized && autoPreprocess)
+    {
+        if (terrainAcc != NULL) // wraps the previous choice
+        {
+            delete terrainAcc->getTriangles();
+            delete terrainAcc;
+            terrainAcc = NULL;
+        }
+        else
+        {
+            delete accelerator;
+        }
+        accelerator = AccSelector::select(&scene, txPoint);
+        initialized = true;
+    }
+    if (!primitives.empty() && accelerator != terrainAcc)
+    {
+        terrainAcc = new TerrainAcc(accelerator, &primitives);
+        accelerator = terrainAcc;
+        if (initialized) // built by AccSelector::select()
+        {
+            terrainAcc->initPrimitives();
+        }
+    }
+    if (!initialized)
+        accelerator->init();
+
+    if (diffractionEnabled && (sceneChanged || !edgesBuilt))
+    {
+        edgeAcc.build(scene, diffractionMinAngle);
+        edgesBuilt = true;
+    }
+    else if (sceneChanged)
+    {
+        edgeAcc.clear();
+        edgesBuilt = false;
+    }
+
+    acceleratorBuilt = true;
+    addedObjects.clear();
+    for (unsigned int i = 0; i < removedObjects.size(); i++)
+    {
+        delete removedObjects[i];
+    }
+    removedObjects.clear();
+
+    select_kernel();
     Utils::PrintTime("Preprocessing finished");
 
     // TODO: print warning messages
     //       when other parameters have not been specified
+}
 
-    // Generate rays
-    // example: ray spacing = 60 degree
-    //        0     60    120   180   240   300
-    // theta: o-----o-----o-----o-----o-----o-----x
-    //           30    90    150
-    // phi:   ---o-----o-----o---
-    int nTheta = (int)(360.0 / parameters.raySpacing + 0.5);
-    int nPhi = (int)(180.0 / parameters.raySpacing + 0.5);
+bool spill()
+{
+    fprintf(stderr, "\n    Spill %d paths to disk (run %d)\n", storedPaths, rxSpill.RunCount());
+    storedPaths = 0; // on failure, tried again after the next "memoryLimit"
+    if (!rxSpill.Spill(rxFields))
+    {
+        fprintf(stderr, "Error: Failed to spill rx fields, they are kept in memory\n");
+        return false;
+    }
+    return true;
+}
 
-    for (int i = 0; i < nTheta; i++)
+void check_memory_limit()
+{
+    if (memoryLimit > 0 &&
+        (long long)storedPaths * RxFields::BytesPerPath > memoryLimit * 1048576LL)
     {
-        for (int j = 0; j < nPhi; j++)
-        {
-            double theta = i * PI * 2.0 / nTheta;
-            double phi = (j + 0.5) * PI / nPhi;
+        spill();
+    }
+}
 
-            double theta1 = i * PI * 2.0 / nTheta;
-            double theta2 = (i + 1) * PI * 2.0 / nTheta;
-            double phi1 = j * PI / nPhi;
-            double phi2 = (j + 1) * PI / nPhi;
-            double unitSufaceArea = calc_sphere_area(theta1, theta2, phi1, phi2);
+// Uniform random number in [0, 1) of a launch cell, only depends on the seed
+// and the cell, so that a resumed simulation or a sweep step launches the
+// same rays
+double cell_random(int i, int j, int k)
+{
+    unsigned long long x = launchSeed;
+    x = x * 0x9E3779B97F4A7C15ULL + (unsigned int)i;
+    x = x * 0x9E3779B97F4A7C15ULL + (unsigned int)j;
+    x = x * 0x9E3779B97F4A7C15ULL + (unsigned int)k;
+
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return (x >> 11) * (1.0 / 9007199254740992.0); // 53 bits
+}
 
-            Ray ray(txPoint, Vector(sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi)), unitSufaceArea);
-            trace(ray, 0);
-        }
-        fprintf(stderr, "\rSimulating [%d / %d]", i + 1, nTheta);
+Vector get_ray_direction(int i, int j, int nTheta, int nPhi)
+{
+    double theta, phi;
+    if (launchJitter)
+    {
+        // A random direction in the cell, uniform over its solid angle
+        // (the cell keeps its surface area in launch_rays())
+        double cos1 = cos(j * PI / nPhi);
+        double cos2 = cos((j + 1) * PI / nPhi);
+        theta = (i + cell_random(i, j, 0)) * PI * 2.0 / nTheta;
+        phi = acos(cos1 + (cos2 - cos1) * cell_random(i, j, 1));
     }
-    fprintf(stderr, "\n");
-    Utils::PrintTime("Sinulation finished");
+    else
+    {
+        theta = i * PI * 2.0 / nTheta;
+        phi = (j + 0.5) * PI / nPhi;
+    }
+    return Vector(sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi));
+}
 
-    return true;
+void launch_rays(int i, int nTheta, int nPhi, int firstRow, int lastRow)
+{
+    for (int j = firstRow; j < lastRow; j++)
+    {
+        currentRegion = txSweep.Region(i, j);
+
+        double theta1 = i * PI * 2.0 / nTheta;
+        double theta2 = (i + 1) * PI * 2.0 / nTheta;
+        double phi1 = j * PI / nPhi;
+        double phi2 = (j + 1) * PI / nPhi;
+        double unitSufaceArea = calc_sphere_area(theta1, theta2, phi1, phi2);
+
+        Ray ray(txPoint, get_ray_direction(i, j, nTheta, nPhi), unitSufaceArea);
+        traceKernel(accelerator, ray);
+
+        check_memory_limit();
+    }
 }
 
-void GetRxPowers(double *powers, int n)
+void get_tube_levels(int nFaces, int nTubes, int &faceLevel, int &level)
 {
-    for (unsigned int i = 0; i < rxFields.size(); i++) // for each rx point
+    faceLevel = 0;
+    while (RayTube::FaceCount(faceLevel) < nFaces)
     {
-        ComplexVector sum = rxFields[i].Sum();
-        if (sum.x.a == 0 && sum.x.b == 0 &&
-            sum.y.a == 0 && sum.y.b == 0 &&
-            sum.z.a == 0 && sum.z.b == 0)
-        {
-            powers[i] = txPower - 250.0;
-        }
-        else
-        {
-            powers[i] = calc_power(sum);
-        }
+        faceLevel += 1;
+    }
+    level = faceLevel;
+    while (RayTube::FaceCount(level) < nFaces * nTubes)
+    {
+        level += 1;
+    }
+}
+
+void launch_tubes(int i, int nFaces, int nTubes, int firstRow, int lastRow)
+{
+    int faceLevel, level;
+    get_tube_levels(nFaces, nTubes, faceLevel, level);
+
+    std::vector<RayTube> tubes;
+    RayTube::Launch(txPoint, i, faceLevel, level, tubes);
+    maxTubeLevel = level + maxTubeSplits;
+
+    std::vector<TubeReflection> reflections;
+    for (int j = firstRow; j < lastRow; j++)
+    {
+        currentRegion = txSweep.Region(i, j);
+        trace_tube(tubes[j], 0, reflections, RayPath());
+
+        check_memory_limit();
     }
 }
+
+// Hash of the reflection sequence of a ray (without fields)
+int probe_ray(const Vector &direction)
+{
+    RayPath path;
+    Ray ray(txPoint, direction, 0);
+    for (int depth = 0; depth < parameters.maxReflections; depth++)
+    {
+        std::vector<RxIntersection> rxSpheres;
+        IntersectResult result = accelerator->intersect(ray, rxSpheres);
+        if (!result.hit)
+            break;
+
+        path.addPoint(result.facet);
+
+        const Vector &n = result.normal; // points to the outside
+        Vector nl = (n.dot(ray.direction) < 0) ? n : n * -1; // points to the ray
+        Vector v = ray.direction - nl * 2 * nl.dot(ray.direction);
+
+        ray = Ray(result.position, v, 0);
+        ray.state = Ray::MoreReflect;
+    }
+    return path.hash_code;
+}
+
+// Sequences of the probe rays of a launch column (one per region)
+void launch_probes(int i, int nColumns, int nRows, std::vector<int> &hashes)
+{
+    hashes.clear();
+    if (traceMethod == RayTubes)
+    {
+        int faceLevel, level;
+        get_tube_levels(nColumns, nRows, faceLevel, level);
+
+        std::vector<RayTube> tubes;
+        RayTube::Launch(txPoint, i, faceLevel, level, tubes);
+        for (unsigned int j = 0; j < tubes.size(); j += TxSweep::RowsPerRegion)
+        {
+            hashes.push_back(probe_ray(tubes[j].center()));
+        }
+    }
+    else
+    {
+        for (int j = 0; j < nRows; j += TxSweep::RowsPerRegion)
+        {
+            hashes.push_back(probe_ray(get_ray_direction(i, j, nColumns, nRows)));
+        }
+    }
+}
+
+void launch_column(int i, int nColumns, int nRows, int firstRow, int lastRow)
+{
+    tracedRays += lastRow - firstRow;
+    if (traceMethod == RayTubes)
+        launch_tubes(i, nColumns, nRows, firstRow, lastRow);
+    else
+        launch_rays(i, nColumns, nRows, firstRow, lastRow);
+}
+
+// Angle (0 .. 2 PI) of the direction d around the edge, from face 0 through the outside
+double edge_angle(const EdgeAcc::Edge &edge, const Vector &d)
+{
+    double phi = atan2(d.dot(edge.normal0), d.dot(edge.face0));
+    return phi < 0 ? phi + 2 * PI : phi;
+}
+
+// Is the segment p -> p + d * distance free of triangles (the ends excluded)?
+bool segment_clear(const Point &p, const Vector &d, double distance)
+{
+    const double margin = 1e-3;
+    std::vector<RxIntersection> rxSpheres;
+    Ray ray(p + d * margin, d, 0);
+    IntersectResult result = accelerator->intersect(ray, rxSpheres);
+    return !result.hit || result.distance >= distance - 2 * margin;
+}
+
+// Fields diffracted once by the edges near the tx-rx segment (UTD): the
+// diffraction point Q on an edge makes equal angles with the edge towards the
+// tx and the rx points (Keller cone), and both segments tx -> Q, Q -> rx are free
+int add_diffracted_fields(int rx, std::vector<int> &candidates)
+{
+    Vector sr(txPoint, rxPoints[rx]);
+    double length = sr.length();
+    if (length < 1e-9)
+        return 0;
+    edgeAcc.query(txPoint, sr.norm(), length, diffractionRadius, candidates);
+
+    int found = 0;
+    for (unsigned int c = 0; c < candidates.size(); c++)
+    {
+        const EdgeAcc::Edge &edge = edgeAcc.get(candidates[c]);
+
+        // Diffraction point: unfold tx and rx around the edge line
+        Vector as(edge.a, txPoint);
+        Vector ar(edge.a, rxPoints[rx]);
+        double tS = as.dot(edge.e);
+        double tR = ar.dot(edge.e);
+        double dS = (as - edge.e * tS).length();
+        double dR = (ar - edge.e * tR).length();
+        if (dS + dR < 1e-9)
+            continue;
+        double t = tS + (tR - tS) * dS / (dS + dR);
+        if (t < 0 || t > edge.length)
+            continue;
+        Point Q = edge.a + edge.e * t;
+
+        Vector si(txPoint, Q); // incident
+        Vector sd(Q, rxPoints[rx]); // diffracted
+        double s1 = si.length();
+        double s2 = sd.length();
+        if (s1 < 1e-6 || s2 < 1e-6)
+            continue;
+        si.norm();
+        sd.norm();
+
+        // Both directions must be outside of the wedge
+        double phiInc = edge_angle(edge, si * -1);
+        double phi = edge_angle(edge, sd);
+        if (phiInc >= edge.n * PI || phi >= edge.n * PI)
+            continue;
+
+        if (!segment_clear(txPoint, si, s1) || !segment_clear(Q, sd, s2))
+            continue;
+
+        double sinBeta0 = edge.e.cross(si).length();
+        if (sinBeta0 < 1e-6)
+            continue;
+
+        ComplexNumber Ds(0, 0), Dh(0, 0);
+        calc_utd_coeff(edge.n, phi, phiInc, s1 * s2 * sinBeta0 * sinBeta0 / (s1 + s2), sinBeta0, Ds, Dh);
+
+        // Edge fixed unit vectors
+        Vector phiI = edge.e.cross(si).norm() * -1;
+        Vector betaI = si.cross(phiI);
+        Vector phiD = edge.e.cross(sd).norm();
+        Vector betaD = sd.cross(phiD);
+
+        // E(rx) = E(Q) . (-betaI betaD Ds - phiI phiD Dh) * A(s) e^(-jks)
+        Ray ray(txPoint, si, 0);
+        PolarField Ei = calc_field_direct(ray, s1);
+        ComplexNumber spread = ComplexNumber::Euler(sqrt(s1 / (s2 * (s1 + s2))), -parameters.k * s2);
+        ComplexNumber Ts = Ds * spread * -1;
+        ComplexNumber Th = Dh * spread * -1;
+        PolarField Ed(
+            (complex_dot(Ei.theta, betaI) * Ts) * betaD + (complex_dot(Ei.theta, phiI) * Th) * phiD,
+            (complex_dot(Ei.phi, betaI) * Ts) * betaD + (complex_dot(Ei.phi, phiI) * Th) * phiD);
+
+        RayPath path;
+        path.addPoint(RayPath::diffraction(edge.index));
+        if (rxFields[rx].AddField(Ed, path, 0, si, sd))
+            storedPaths += 1;
+        if (recorder != NULL)
+        {
+            std::vector<Point> points;
+            points.push_back(txPoint);
+            points.push_back(Q);
+            points.push_back(rxPoints[rx]);
+            recorder->RecordPath(rx, points, path.hash_code);
+        }
+        found += 1;
+    }
+    return found;
+}
+
+// The direct field of every rx point, with one shadow ray per rx point
+void add_direct_fields()
+{
+    // 1. Shadow rays
+    std::vector<int> visibleRx;
+    std::vector<double> amplitudes;
+    std::vector<double> phases;
+    for (unsigned int i = 0; i < rxPoints.size(); i++)
+    {
+        Vector d(txPoint, rxPoints[i]);
+        double distance = d.length();
+        if (distance < 1e-9) // rx point at the tx point
+            continue;
+
+        std::vector<RxIntersection> rxSpheres;
+        Ray ray(txPoint, d.norm(), 0);
+        IntersectResult result = accelerator->intersect(ray, rxSpheres);
+        if (result.hit && result.distance < distance) // blocked
+            continue;
+
+        visibleRx.push_back(i);
+        amplitudes.push_back(parameters.txField / distance);
+        phases.push_back(-parameters.k * distance);
+    }
+
+    // 2. The phases of all the visible rx points at once
+    int visible = (int)visibleRx.size();
+    std::vector<double> re(visible), im(visible);
+    if (visible > 0)
+    {
+        ComplexNumber::Euler(&amplitudes[0], &phases[0], &re[0], &im[0], visible);
+    }
+
+    // 3. Fields
+    for (int k = 0; k < visible; k++)
+    {
+        int i = visibleRx[k];
+        Ray ray(txPoint, Vector(txPoint, rxPoints[i]).norm(), 0);
+        PolarField Ez = calc_field_direct(ray, ComplexNumber(re[k], im[k]));
+        if (rxFields[i].AddField(Ez, ray.path, 0, ray.direction, ray.direction))
+            storedPaths += 1;
+        if (recorder != NULL)
+        {
+            std::vector<Point> points;
+            points.push_back(txPoint);
+            points.push_back(rxPoints[i]);
+            recorder->RecordPath(i, points, ray.path.hash_code);
+        }
+    }
+    fprintf(stderr, "    Line of sight: %d / %d rx points\n", visible, (int)rxPoints.size());
+
+    if (diffractionEnabled)
+    {
+        int diffracted = 0;
+        long long candidates = 0;
+        std::vector<int> edges;
+        for (unsigned int i = 0; i < rxPoints.size(); i++)
+        {
+            diffracted += add_diffracted_fields(i, edges);
+            candidates += edges.size();
+        }
+        fprintf(stderr, "    Diffraction: %d paths, %.1lf of %d edges tested per rx point\n",
+            diffracted, rxPoints.empty() ? 0.0 : (double)candidates / rxPoints.size(), edgeAcc.size());
+    }
+
+    check_memory_limit();
+}
+
+void start_recorder()
+{
+    if (!rayRecorderFilename.empty() && rayRecorder.Open(rayRecorderFilename.c_str()))
+        recorder = &rayRecorder;
+}
+
+void stop_recorder()
+{
+    if (recorder != NULL)
+        recorder->Close();
+    recorder = NULL;
+}
+
+void start_sampling()
+{
+    rxSampling.Reset(0);
+    if (samplingEnabled && traceMethod == RaySpheres)
+    {
+        rxSampling.Reset((int)rxPoints.size());
+        sampling = &rxSampling;
+    }
+}
+
+void stop_sampling()
+{
+    if (sampling == NULL)
+        return;
+    sampling = NULL;
+
+    fprintf(stderr, "    Sampling: %d paths, %d with less than %d hits, recommended spacing %.3lf deg (now %.3lf deg)\n",
+        rxSampling.CountPaths(), rxSampling.CountUndersampled(samplingMinHits), samplingMinHits,
+        rxSampling.RecommendSpacing(parameters.raySpacing, samplingMinHits), parameters.raySpacing);
+}
+
+void start_transmission()
+{
+    transmission.rays = 0;
+    transmission.branches = 0;
+    transmission.pruned = 0;
+    transmission.prunedPower = 0;
+}
+
+void stop_transmission()
+{
+    if (!transmission.enabled || transmission.rays == 0)
+        return;
+
+    fprintf(stderr, "    Transmission: %.2lf branches per ray, %lld pruned (%.3lf%% of the launched power)\n",
+        (double)transmission.branches / transmission.rays, transmission.pruned,
+        100.0 * transmission.prunedPower / transmission.rays);
+}
+
+void launch(int nColumns, int nRows, int firstColumn)
+{
+    Checkpoint checkpoint;
+    CheckpointHeader header; // hashes the scene once
+    int lastCheckpoint = Utils::GetTickCount();
+    if (checkpointInterval > 0)
+    {
+        header = make_checkpoint_header(nColumns, nRows, firstColumn);
+    }
+
+    start_recorder();
+    start_sampling();
+    start_transmission();
+
+    if (firstColumn == 0) // a resumed simulation has them in the checkpoint
+    {
+        add_direct_fields();
+    }
+
+    for (int i = firstColumn; i < nColumns; i++)
+    {
+        launch_column(i, nColumns, nRows, 0, nRows);
+
+        if (sweeping)
+        {
+            std::vector<int> hashes;
+            launch_probes(i, nColumns, nRows, hashes);
+            for (unsigned int k = 0; k < hashes.size(); k++)
+            {
+                txSweep.SetProbe(txSweep.Region(i, k * TxSweep::RowsPerRegion), hashes[k]);
+            }
+        }
+
+        fprintf(stderr, "\rSimulating [%d / %d]", i + 1, nColumns);
+
+        // Save checkpoint (columns [0, i] are finished)
+        if (checkpointInterval > 0 && 
+            Utils::GetTickCount() - lastCheckpoint >= checkpointInterval * 1000)
+        {
+            header.nextColumn = i + 1;
+            header.spillRuns = rxSpill.RunCount();
+            if (checkpoint.Save(checkpointFilename.c_str(), header, rxFields))
+            {
+                lastCheckpoint = Utils::GetTickCount();
+            }
+        }
+    }
+    fprintf(stderr, "\n");
+
+    stop_recorder();
+    stop_sampling();
+    stop_transmission();
+    KdTreeAcc::PrintTestStats();
+    checkpoint.Wait();
+}
+
+// Pin the trace thread to the node it runs on (before the accelerator is built)
+void numa_pin()
+{
+    tracedRays = 0;
+    numaStart = Utils::GetTickCount();
+    if (!numaPlacement || Utils::GetNumaNodeCount() <= 1)
+        return;
+
+    int node = Utils::GetCurrentNumaNode();
+    numaAffinity = Utils::PinThread(node);
+    if (numaAffinity.mask == 0)
+        fprintf(stderr, "    NUMA: Failed to pin the trace thread to node %d\n", node);
+}
+
+// Unpin the trace thread and count its rays
+void numa_unpin()
+{
+    if (!numaPlacement)
+        return;
+
+    int node = Utils::GetPinnedNumaNode();
+    if (node < 0)
+        node = Utils::GetCurrentNumaNode();
+    Utils::UnpinThread(numaAffinity);
+    numaAffinity.mask = 0;
+
+    if ((int)nodeRays.size() <= node)
+    {
+        nodeRays.resize(node + 1, 0);
+        nodeTicks.resize(node + 1, 0);
+    }
+    nodeRays[node] += tracedRays;
+    nodeTicks[node] += Utils::GetTickCount() - numaStart;
+
+    for (unsigned int i = 0; i < nodeRays.size(); i++)
+    {
+        if (nodeRays[i] > 0)
+        {
+            fprintf(stderr, "    NUMA node %d: %lld rays, %.0lf rays/s\n", i, nodeRays[i],
+                nodeRays[i] * 1000.0 / std::max(nodeTicks[i], 1));
+        }
+    }
+}
+
+bool simulate()
+{
+    numa_pin();
+    rxSpill.Reset();
+    prepare();
+
+    int nColumns, nRows;
+    get_launch_size(nColumns, nRows);
+
+    if (sweeping)
+        txSweep.Reset(sweep_settings(nColumns, nRows));
+
+    launch(nColumns, nRows, 0);
+    Utils::PrintTime("Sinulation finished");
+    numa_unpin();
+
+    return true;
+}
+
+bool Simulate() 
+{
+    sweeping = false;
+    txSweep.Reset();
+    return simulate();
+}
+
+// One step of a tx sweep: reuse the paths of the regions that did not change
+void sweep(int nColumns, int nRows)
+{
+    rxSpill.Reset();
+    for (unsigned int i = 0; i < rxFields.size(); i++)
+    {
+        rxFields[i].Clear();
+    }
+    storedPaths = 0;
+
+    start_recorder();
+    add_direct_fields();
+
+    // Regions whose probe rays follow other sequences now
+    int nRegions = txSweep.RegionCount();
+    std::vector<bool> retrace(nRegions, false);
+    std::vector<int> probes(nRegions, 0);
+    for (int i = 0; i < nColumns; i++)
+    {
+        std::vector<int> hashes;
+        launch_probes(i, nColumns, nRows, hashes);
+        for (unsigned int k = 0; k < hashes.size(); k++)
+        {
+            int region = txSweep.Region(i, k * TxSweep::RowsPerRegion);
+            probes[region] = hashes[k];
+            retrace[region] = (hashes[k] != txSweep.GetProbe(region));
+        }
+    }
+
+    // Revalidate the paths of the other regions at the new tx point
+    const std::vector<TxSweep::Path> &paths = txSweep.GetPaths();
+    std::vector<PolarField> fields(paths.size());
+    std::vector<Vector> departures(paths.size()), arrivals(paths.size());
+    std::vector<std::vector<Point> > pathPoints(recorder != NULL ? paths.size() : 0); // for the recorder
+    std::vector<TubeReflection> reflections;
+    std::vector<Point> points;
+
+    for (unsigned int i = 0; i < paths.size(); i++)
+    {
+        const TxSweep::Path &path = paths[i];
+        if (!TxSweep::Found(path, retrace))
+            continue;
+
+        // Image sources of the sequence (only planar triangles can be reused)
+        bool planar = true;
+        reflections.resize(path.reflections.size());
+        Point source = txPoint;
+        for (unsigned int j = 0; j < path.reflections.size(); j++)
+        {
+            if (path.reflections[j]->type != TRIANGLE)
+            {
+                planar = false;
+                break;
+            }
+
+            const Triangle *t = (const Triangle *)path.reflections[j];
+            Vector n = t->normal;
+            n.norm();
+            source = source + n * (-2 * Vector(t->a, source).dot(n));
+
+            reflections[j].point = t->a;
+            reflections[j].normal = n;
+            reflections[j].geometry = path.reflections[j];
+            reflections[j].facet = t->index;
+            reflections[j].material = t->material;
+            reflections[j].source = source;
+        }
+
+        if (planar)
+        {
+            unfold_path(reflections, rxPoints[path.rx], points);
+        }
+        if (!planar || !check_path(reflections, points))
+        {
+            for (unsigned int j = 0; j < path.regions.size(); j++) // their sequence sets have changed
+            {
+                retrace[path.regions[j]] = true;
+            }
+            continue;
+        }
+        fields[i] = calc_field_path(reflections, points);
+        path_directions(points, departures[i], arrivals[i]);
+        if (recorder != NULL)
+            pathPoints[i] = points;
+    }
+
+    int reused = 0;
+    for (unsigned int i = 0; i < paths.size(); i++)
+    {
+        if (!TxSweep::Found(paths[i], retrace))
+            continue;
+
+        RayPath path;
+        for (unsigned int j = 0; j < paths[i].reflections.size(); j++)
+        {
+            path.addPoint(paths[i].reflections[j]->index);
+        }
+        if (rxFields[paths[i].rx].AddField(fields[i], path, 0, departures[i], arrivals[i]))
+            storedPaths += 1;
+        if (recorder != NULL)
+            recorder->RecordPath(paths[i].rx, pathPoints[i], path.hash_code);
+        reused += 1;
+    }
+    check_memory_limit();
+
+    // Trace the changed regions again
+    txSweep.RemoveRegions(retrace);
+
+    int retraced = 0;
+    for (int i = 0; i < nRegions; i++)
+    {
+        if (retrace[i])
+        {
+            int column, firstRow, lastRow;
+            txSweep.GetRows(i, column, firstRow, lastRow);
+            launch_column(column, nColumns, nRows, firstRow, lastRow);
+            retraced += 1;
+        }
+        txSweep.SetProbe(i, probes[i]);
+    }
+    fprintf(stderr, "    Sweep: %d / %d regions retraced, %d paths reused\n", retraced, nRegions, reused);
+
+    stop_recorder();
+}
+
+bool SweepTx(const RtPoint &point)
+{
+    SetTxPoint(point, txPower);
+
+    int nColumns, nRows;
+    get_launch_size(nColumns, nRows);
+
+    // The sweep does not follow transmitted branches, every step is a full simulation
+    if (transmission.enabled)
+    {
+        sweeping = false;
+        return simulate();
+    }
+
+    // The first step (or a step after the settings changed) is a full simulation
+    if (!sweeping || !txSweep.Matches(sweep_settings(nColumns, nRows)))
+    {
+        sweeping = true;
+        return simulate();
+    }
+
+    numa_pin();
+    sweep(nColumns, nRows);
+    Utils::PrintTime("Sweep step finished");
+    numa_unpin();
+
+    return true;
+}
+
+void SetLaunchJitter(bool enable, unsigned int seed)
+{
+    launchJitter = enable;
+    launchSeed = seed;
+    if (enable)
+        fprintf(stderr, "    Launch: stratified jitter (seed %u)\n", seed);
+    else
+        fprintf(stderr, "    Launch: regular grid\n");
+}
+
+void SetTransmission(bool enable, double wallThickness, int maxTransmissions, double powerFloorDb, int maxBranches)
+{
+    transmission.enabled = enable;
+    transmission.wallThickness = wallThickness;
+    transmission.maxTransmissions = std::max(maxTransmissions, 0);
+    transmission.powerFloor = pow(10.0, -fabs(powerFloorDb) / 10.0);
+    transmission.maxBranches = std::max(maxBranches, 1);
+    if (enable)
+    {
+        fprintf(stderr, "    Transmission: %.2lf m walls, up to %d per path, floor -%.0lf dB, %d branches per ray\n",
+            wallThickness, transmission.maxTransmissions, fabs(powerFloorDb), transmission.maxBranches);
+        if (traceMethod == RayTubes)
+            fprintf(stderr, "    Transmission: not supported by ray tubes, only the ray spheres trace it\n");
+    }
+}
+
+void SetDiffraction(bool enable, double searchRadius)
+{
+    diffractionEnabled = enable;
+    diffractionRadius = searchRadius;
+    if (enable)
+        fprintf(stderr, "    Diffraction: edges within %.1lf m of the tx-rx segments\n", searchRadius);
+}
+
+void SetSamplingDiagnostics(bool enable, int minHits)
+{
+    samplingEnabled = enable;
+    samplingMinHits = std::max(minHits, 1);
+}
+
+bool GetSamplingDiagnostics(int *paths, int *minHits, double *expectedHits, int n)
+{
+    if (rxSampling.Empty() || n != (int)rxPoints.size())
+    {
+        fprintf(stderr, "Error: No sampling diagnostics for %d rx points\n", n);
+        return false;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        rxSampling.Get(i, paths[i], minHits[i], expectedHits[i]);
+    }
+    return true;
+}
+
+double GetRecommendedSpacing()
+{
+    return rxSampling.RecommendSpacing(parameters.raySpacing, samplingMinHits);
+}
+
+void SetNumaPlacement(bool enable)
+{
+    numaPlacement = enable;
+    int nodes = Utils::GetNumaNodeCount();
+    if (enable && nodes <= 1)
+        fprintf(stderr, "    NUMA placement: single node, nothing to place\n");
+    else if (enable)
+        fprintf(stderr, "    NUMA placement: on (%d nodes)\n", nodes);
+    else
+        fprintf(stderr, "    NUMA placement: off\n");
+}
+
+void SetRayRecorder(const char *filename)
+{
+    rayRecorderFilename = (filename != NULL) ? filename : "";
+    if (rayRecorderFilename.empty())
+        fprintf(stderr, "    Ray recorder: off\n");
+    else
+        fprintf(stderr, "    Ray recorder: \"%s\"\n", filename);
+}
+
+void SetRayRecorderFilter(int rx, int minDepth, int maxDepth,
+    double thetaMin, double thetaMax, double phiMin, double phiMax)
+{
+    rayRecorder.SetFilter(rx, minDepth, maxDepth, thetaMin, thetaMax, phiMin, phiMax);
+}
+
+bool ConvertRayRecord(const char *filename, const char *vtkFilename)
+{
+    return RayRecorder::Convert(filename, vtkFilename);
+}
+
+bool SetTraceMethod(RtTraceMethod method)
+{
+    if (method == RaySpheres)
+    {
+        fprintf(stderr, "    Trace method: Ray spheres\n");
+    }
+    else if (method == RayTubes)
+    {
+        fprintf(stderr, "    Trace method: Ray tubes\n");
+    }
+    else
+    {
+        fprintf(stderr, "Error: Unknown trace method\n");
+        return false;
+    }
+
+    traceMethod = method;
+    return true;
+}
+
+void SetCheckpoint(const char *filename, int interval)
+{
+    checkpointFilename = (filename != NULL) ? filename : "";
+    checkpointInterval = (filename != NULL) ? interval : 0;
+    fprintf(stderr, "    Checkpoint: \"%s\" every %d seconds\n", checkpointFilename.c_str(), checkpointInterval);
+}
+
+bool Resume(const char *filename)
+{
+    int nColumns, nRows;
+    get_launch_size(nColumns, nRows);
+
+    // Check the checkpoint before the (expensive) preprocessing
+    CheckpointHeader header;
+    std::vector<RxFields> fields;
+    if (!Checkpoint::Load(filename, make_checkpoint_header(nColumns, nRows, 0), header, fields))
+        return false;
+
+    numa_pin();
+    prepare();
+    rxFields.swap(fields);
+
+    rxSpill.Restore(header.spillRuns);
+    storedPaths = 0;
+    for (unsigned int i = 0; i < rxFields.size(); i++)
+    {
+        storedPaths += rxFields[i].Count();
+    }
+
+    fprintf(stderr, "    Resume from [%d / %d]\n", header.nextColumn, nColumns);
+    launch(nColumns, nRows, header.nextColumn);
+    Utils::PrintTime("Sinulation finished");
+    numa_unpin();
+
+    return true;
+}
+
+void SetMemoryLimit(int megabytes, const char *spillDirectory)
+{
+    memoryLimit = megabytes;
+    rxSpill.SetDirectory(spillDirectory);
+    fprintf(stderr, "    Memory limit of rx fields: %d MB (spill to \"%s\")\n",
+        megabytes, spillDirectory != NULL ? spillDirectory : ".");
+}
+
+double *rxPowersOutput = NULL; // used by set_rx_power() while merging spilled runs
+
+void set_rx_power(int i, PolarField &fields)
+{
+    ComplexVector sum = fields.Combine(txPolarTheta, txPolarPhi);
+    if (sum.x.a == 0 && sum.x.b == 0 &&
+        sum.y.a == 0 && sum.y.b == 0 &&
+        sum.z.a == 0 && sum.z.b == 0)
+    {
+        rxPowersOutput[i] = txPower - 250.0;
+    }
+    else
+    {
+        rxPowersOutput[i] = calc_power(sum);
+    }
+}
+
+bool GetRxPowers(double *powers, int n)
+{
+    rxPowersOutput = powers;
+
+    if (rxSpill.RunCount() > 0) // some fields are on disk
+    {
+        // The rest as the last run
+        if (!spill() || !rxSpill.Merge((int)rxFields.size(), set_rx_power))
+        {
+            fprintf(stderr, "Error: Failed to merge the spilled rx fields, no rx powers available\n");
+            for (unsigned int i = 0; i < rxFields.size(); i++)
+            {
+                powers[i] = txPower - 250.0;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    for (unsigned int i = 0; i < rxFields.size(); i++) // for each rx point
+    {
+        PolarField sum = rxFields[i].Sum();
+        set_rx_power(i, sum);
+    }
+    return true;
+}
+
+bool GetRxPathCounts(int *counts, int n)
+{
+    if (rxSpill.RunCount() > 0)
+    {
+        fprintf(stderr, "Error: the paths were spilled to disk, no path counts available\n");
+        return false;
+    }
+
+    for (int i = 0; i < n && i < (int)rxFields.size(); i++)
+    {
+        counts[i] = rxFields[i].Count();
+    }
+    return true;
+}
+
+// Unit theta and phi directions of a wave travelling along "dir" (the same
+// base as calc_field_direct() uses at the tx point)
+void calc_polar_base(const Vector &dir, Vector &theta, Vector &phi)
+{
+    phi = Vector(0, 0, 1).cross(dir);
+    if (phi.length() < 1e-9) // vertical
+        phi = Vector(0, 1, 0);
+    phi.norm();
+    theta = phi.cross(dir).norm();
+}
+
+bool GetChannelMatrix(int rx, double *re, double *im)
+{
+    if (rx < 0 || rx >= (int)rxFields.size())
+    {
+        fprintf(stderr, "Error: invalid rx point %d\n", rx);
+        return false;
+    }
+    if (rxSpill.RunCount() > 0)
+    {
+        fprintf(stderr, "Error: the paths were spilled to disk, no channel matrix available\n");
+        return false;
+    }
+
+    // Without arrays both sides are a single element at the center
+    std::vector<Vector> txArray = txElements.empty() ? std::vector<Vector>(1) : txElements;
+    std::vector<Vector> rxArray = rxElements.empty() ? std::vector<Vector>(1) : rxElements;
+    int nTx = (int)txArray.size();
+    int nRx = (int)rxArray.size();
+    for (int i = 0; i < nTx * nRx; i++)
+    {
+        re[i] = 0;
+        im[i] = 0;
+    }
+
+    // Plane waves across the arrays: an element at offset d from the center
+    // shortens the path by d . departure (tx) and lengthens it by d . arrival (rx)
+    std::vector<RxPathField> fields;
+    rxFields[rx].Collect(fields);
+
+    // The element phases of a path are evaluated at once
+    std::vector<double> ones(nTx * nRx, 1.0);
+    std::vector<double> phases(nTx * nRx);
+    std::vector<double> cosines(nTx * nRx);
+    std::vector<double> sines(nTx * nRx);
+
+    double amplitude = sqrt(parameters.powerFactor);
+    for (unsigned int p = 0; p < fields.size(); p++) // for each path
+    {
+        const RxField &f = fields[p].field;
+        ComplexVector E = f.field.Combine(txPolarTheta, txPolarPhi);
+
+        // Projection onto the rx polarization in the arrival base: <u, E> = conj(u) . E
+        Vector theta, phi;
+        calc_polar_base(f.arrival, theta, phi);
+        ComplexNumber E_theta = E.x * theta.x + E.y * theta.y + E.z * theta.z;
+        ComplexNumber E_phi = E.x * phi.x + E.y * phi.y + E.z * phi.z;
+        ComplexNumber a = (E_theta * ComplexNumber(rxPolarTheta.a, -rxPolarTheta.b) +
+                           E_phi * ComplexNumber(rxPolarPhi.a, -rxPolarPhi.b)) * amplitude;
+
+        for (int r = 0; r < nRx; r++)
+        {
+            double phaseRx = -parameters.k * rxArray[r].dot(f.arrival);
+            for (int t = 0; t < nTx; t++)
+            {
+                phases[r * nTx + t] = parameters.k * txArray[t].dot(f.departure) + phaseRx;
+            }
+        }
+        ComplexNumber::Euler(&ones[0], &phases[0], &cosines[0], &sines[0], nTx * nRx);
+
+        for (int i = 0; i < nTx * nRx; i++)
+        {
+            ComplexNumber h = a * ComplexNumber(cosines[i], sines[i]);
+            re[i] += h.a;
+            im[i] += h.b;
+        }
+    }
+    return true;
+}
+
+bool GetRxPolarPowers(double *copolar, double *crosspolar, int n)
+{
+    if (rxSpill.RunCount() > 0)
+    {
+        fprintf(stderr, "Error: the paths were spilled to disk, no polarization powers available\n");
+        return false;
+    }
+
+    // Orthogonal polarization (cross-polar) of the tx polarization
+    double w = sqrt(txPolarTheta.a * txPolarTheta.a + txPolarTheta.b * txPolarTheta.b +
+                    txPolarPhi.a * txPolarPhi.a + txPolarPhi.b * txPolarPhi.b);
+    ComplexNumber coTheta = txPolarTheta * (1 / w);
+    ComplexNumber coPhi = txPolarPhi * (1 / w);
+    ComplexNumber crossTheta = ComplexNumber(-coPhi.a, coPhi.b); // -conj(coPhi)
+    ComplexNumber crossPhi = ComplexNumber(coTheta.a, -coTheta.b); // conj(coTheta)
+
+    std::vector<RxPathField> fields;
+    for (int i = 0; i < n && i < (int)rxFields.size(); i++) // for each rx point
+    {
+        ComplexNumber co(0, 0);
+        ComplexNumber cross(0, 0);
+
+        rxFields[i].Collect(fields);
+        for (unsigned int p = 0; p < fields.size(); p++) // for each path
+        {
+            const RxField &f = fields[p].field;
+            ComplexVector E = f.field.Combine(txPolarTheta, txPolarPhi);
+
+            // Components of the field in the polarization base of the arriving wave
+            Vector theta, phi;
+            calc_polar_base(f.arrival, theta, phi);
+            ComplexNumber E_theta = E.x * theta.x + E.y * theta.y + E.z * theta.z;
+            ComplexNumber E_phi = E.x * phi.x + E.y * phi.y + E.z * phi.z;
+
+            // Projections onto the co-polar and the cross-polar states: <u, E> = conj(u) . E
+            co = co + E_theta * ComplexNumber(coTheta.a, -coTheta.b) + E_phi * ComplexNumber(coPhi.a, -coPhi.b);
+            cross = cross + E_theta * ComplexNumber(crossTheta.a, -crossTheta.b) + E_phi * ComplexNumber(crossPhi.a, -crossPhi.b);
+        }
+
+        double coSqr = co.a * co.a + co.b * co.b;
+        double crossSqr = cross.a * cross.a + cross.b * cross.b;
+        copolar[i] = coSqr > 0 ? 10 * log10(parameters.powerFactor * coSqr) + 30.0 : txPower - 250.0;
+        crosspolar[i] = crossSqr > 0 ? 10 * log10(parameters.powerFactor * crossSqr) + 30.0 : txPower - 250.0;
+    }
+    return true;
+}
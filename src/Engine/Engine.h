@@ -36,18 +36,71 @@ enum RtPreprocessMethod
 {
     Linear,
     Grid,
-    KdTree
+    KdTree,
+    Auto,   // picked from the scene statistics in every Simulate()
+    Hybrid  // coarse 2D grid of kd-trees, for large flat (city-scale) scenes
+};
+
+enum RtTraceMethod
+{
+    RaySpheres, // shooting and bouncing rays, received by rx spheres
+    RayTubes    // triangular ray tubes, rx points are tested for containment
 };
 
 void Initialize();
 
+// Materials: AddMaterial() returns the ID of a new material (1, 2, ...), ID 0
+// is the material of SetParameters(). The triangles, heightfields and buildings
+// added after SetMaterial() are made of that material (until the next call).
+// Initialize() removes the materials.
+int AddMaterial(double permittivity, double conductivity);
+bool SetMaterial(int id);
+
 void AddTriangle(const RtTriangle &triangle);
 void AddTriangles(const RtTriangle *triangles, int n);
 bool AddStlModel(const char *filename); // TODO: add unicode version
 
+// Scene edits between simulations (e.g. a planned building): a group of
+// triangles that can be removed again by its ID. The next Simulate() only
+// updates the cells / subtrees of the accelerator the edit touches, and
+// rebuilds it when the update would degrade it.
+int AddTriangleGroup(const RtTriangle *triangles, int n); // returns the group ID
+bool RemoveTriangleGroup(int id);
+
+// Terrain raster: sample (i, j) is at (x0 + i * cellSize, y0 + j * cellSize, heights[j * nx + i]),
+// the heights are copied
+bool AddHeightfield(const float *heights, int nx, int ny, double x0, double y0, double cellSize);
+
+// Building extruded from a footprint polygon: the walls go from the lowest z of
+// the footprint vertices up by "height", the roof is flat
+bool AddBuilding(const RtPoint *footprint, int n, double height);
+
 bool SetPreprocessMethod(RtPreprocessMethod method);
+bool SetTraceMethod(RtTraceMethod method); // default: RaySpheres
+
+// Stratified jittered launching of shooting and bouncing rays: every ray of
+// the theta / phi launch grid leaves in a random direction inside its cell
+// (reproducible for a seed), which turns the regular hit patterns of the rx
+// spheres into noise. Ray tubes always tile the sphere exactly.
+void SetLaunchJitter(bool enable, unsigned int seed);
+
 void SetTxPoint(const RtPoint &point, double power); // power in dBm
-void SetRxPoints(const RtPoint *points, int n, double radius); // radius in meters
+void SetRxPoints(const RtPoint *points, int n, double radius); // radius in meters (unused by ray tubes)
+
+// Tx polarization, evaluated after the trace (the fields of a vertical and a
+// horizontal tx are traced together): tilt from vertical in degrees (0 = vertical,
+// 90 = horizontal) and the phase of the horizontal part (e.g. tilt 45, phase 90
+// for circular polarization). Default: vertical.
+void SetTxPolarization(double tilt, double phase);
+
+// Polarization of the rx array elements used by GetChannelMatrix(), the same
+// angles in the theta / phi base of the arriving wave. Default: vertical.
+void SetRxPolarization(double tilt, double phase);
+
+// Antenna arrays as element offsets in meters from the tx point and from every
+// rx point. The paths are traced once from the centers, the elements are
+// evaluated from the departure / arrival directions of the paths (plane waves).
+void SetArrays(const RtVector *txOffsets, int nTx, const RtVector *rxOffsets, int nRx);
 
 void SetParameters(
     double permittivity,
@@ -58,6 +111,85 @@ void SetParameters(
     );
 
 bool Simulate();
-void GetRxPowers(double *powers, int n);
+
+// Tx sweep: the first call is a full simulation at the point, every later
+// call moves the tx there and only traces the angular regions again whose
+// reflection sequences changed. The other paths are reused after checking
+// them at the new tx point. A call after the geometry, the rx points or the
+// parameters changed is a full simulation again. Simulate() and Initialize()
+// end the sweep.
+bool SweepTx(const RtPoint &point);
+
+// Checkpoint & resume
+// A checkpoint is written every "interval" seconds during Simulate() / Resume().
+// Resume() must be called after the same scene and settings have been restored,
+// it rejects a checkpoint of another scene, other rx points or other settings.
+void SetCheckpoint(const char *filename, int interval); // interval in seconds, 0 disables
+bool Resume(const char *filename);
+
+// Rx powers (dBm). False when spilled fields cannot be merged, the powers are
+// then set to the level of no field (tx power - 250 dB).
+bool GetRxPowers(double *powers, int n);
+
+// Co-polar and cross-polar powers (dBm) of the rx points, the field of every
+// path is projected onto the tx polarization and the orthogonal one as seen
+// in its arrival direction. Not available after spilling.
+bool GetRxPolarPowers(double *copolar, double *crosspolar, int n);
+
+// Number of distinct paths of each rx point (the hits of the same path are
+// merged into one). Not available after spilling.
+bool GetRxPathCounts(int *counts, int n);
+
+// Channel matrix of an rx point, h[r * nTx + t] from tx element t to rx element r
+// (tx polarization of SetTxPolarization(), the field of every path is projected
+// onto the rx polarization of SetRxPolarization() in its arrival direction,
+// |h|^2 in watts). Both arrays have one element at the center when SetArrays()
+// was not called. Not available after spilling.
+bool GetChannelMatrix(int rx, double *re, double *im);
+
+// Ray recorder for visualization and debugging: the segments of the traced
+// rays are written to a binary file during every later Simulate() / SweepTx()
+// (NULL disables). Filters: rx point (-1 = all rays), number of reflections and
+// launch angles in degrees (theta: azimuth from +x, phi: from +z).
+void SetRayRecorder(const char *filename);
+void SetRayRecorderFilter(int rx, int minDepth, int maxDepth,
+    double thetaMin, double thetaMax, double phiMin, double phiMax);
+bool ConvertRayRecord(const char *filename, const char *vtkFilename); // to legacy VTK lines
+
+// Memory limit of the accumulated rx fields
+// When exceeded, the fields are spilled to "spillDirectory" and merged in GetRxPowers()
+void SetMemoryLimit(int megabytes, const char *spillDirectory); // 0 = unlimited
+
+// First order edge diffraction (UTD, perfectly conducting wedges): the fields
+// tx -> edge -> rx of the edges within "searchRadius" of each tx-rx segment are
+// added to the rx points. Diffracting edges are shared by two triangles forming
+// a convex wedge (triangle normals pointing to the outside).
+void SetDiffraction(bool enable, double searchRadius);
+
+// Wall penetration (RaySpheres only): every hit splits the ray into a reflected
+// and a transmitted branch, the transmission through a wall of "wallThickness"
+// (m) of the scene material (ITU-R P.2040 slab). A path passes at most
+// "maxTransmissions" walls. The branches are traced strongest first, a branch
+// carrying less than "powerFloorDb" (dB below the launched ray) is pruned, and
+// at most "maxBranches" branches are traced per launched ray. The walls are
+// single surfaces; the tx sweep runs full simulations while enabled.
+void SetTransmission(bool enable, double wallThickness, int maxTransmissions, double powerFloorDb, int maxBranches);
+
+// Sampling diagnostics of the rx spheres (RaySpheres only): per rx point, the
+// number of distinct paths, the fewest ray hits of a path, and the fewest
+// expected hits of a path (rx sphere cross section / ray tube cross section
+// at the rx point, unit_surface_area * mileage^2). Covers the last simulation.
+// The recommended spacing (degrees) is the coarsest one still expecting
+// "minHits" hits on every path found (0 = no path found). Paths missed by
+// every ray are not known, so start from a spacing that finds them.
+void SetSamplingDiagnostics(bool enable, int minHits);
+bool GetSamplingDiagnostics(int *paths, int *minHits, double *expectedHits, int n);
+double GetRecommendedSpacing();
+
+// NUMA placement: every simulation pins its thread to the node it runs on
+// while the accelerator is built (by threads pinned to the same node) and the
+// rays are traced, so the accelerator is local memory. The rays per second of
+// each node are printed after the run. No effect on single node machines.
+void SetNumaPlacement(bool enable);
 
 #endif
@@ -5,10 +5,34 @@
 Geometry::Geometry()
 {
     index = ++count;
+    material = 0;
+}
+
+Geometry::Geometry(int index)
+{
+    this->index = index;
+    material = 0;
 }
 
 Geometry::~Geometry()
 {
 }
 
+int Geometry::reserveIndexes(int n)
+{
+    int first = count + 1;
+    count += n;
+    return first;
+}
+
+unsigned int Geometry::hashBytes(unsigned int hash, const void *data, int size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (int i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
 int Geometry::count = 0;
\ No newline at end of file
@@ -4,23 +4,34 @@
 #include "Ray.h"
 #include "IntersectResult.h"
 
-enum GeometryType { TRIANGLE, SPHERE };
+enum GeometryType { TRIANGLE, SPHERE, HEIGHTFIELD, BUILDINGS };
 
 class Geometry
 {
 public:
     GeometryType type;
     int index; // Each geometry element in the scene has a unique index
+    unsigned short material; // material ID (0 = the material of SetParameters())
 
 private:
     static int count;
 
+protected:
+    Geometry(int index); // an index of reserveIndexes()
+
 public:
+    static int reserveIndexes(int n); // n more unique indexes (for the facets of a geometry), returns the first
+
+    // FNV-1a hash of the bytes, continued from "hash"
+    static const unsigned int hashSeed = 2166136261u;
+    static unsigned int hashBytes(unsigned int hash, const void *data, int size);
+
     Geometry();
     virtual ~Geometry();
     virtual Point getCenter() const = 0;
-    virtual void getBoundingBox(Point &min, Point &max) = 0;
+    virtual void getBoundingBox(Point &min, Point &max) const = 0;
     virtual IntersectResult intersect(Ray &ray) = 0;
+    virtual unsigned int hash(unsigned int seed) const = 0; // of the shape and the material (see hashBytes())
 };
 
 #endif
@@ -3,6 +3,9 @@
 #include "Utils.h"
 #include "Sphere.h"
 
+#include <algorithm>
+#include <math.h>
+
 std::vector<Geometry *> &GridAcc::get(int x, int y, int z)
 {
     return data[(x * yLength + y) * zLength + z];
@@ -114,6 +117,66 @@ void GridAcc::init()
 #endif
 }
 
+// The cells overlapped by the bounding box, false if it sticks out of the grid
+bool GridAcc::getCellRange(const Geometry *g, int &x1, int &y1, int &z1, int &x2, int &y2, int &z2)
+{
+    Point min, max;
+    g->getBoundingBox(min, max);
+
+    x1 = (int)floor((min.x - origin.x) / cellSizeX);
+    y1 = (int)floor((min.y - origin.y) / cellSizeY);
+    z1 = (int)floor((min.z - origin.z) / cellSizeZ);
+    x2 = (int)floor((max.x - origin.x) / cellSizeX);
+    y2 = (int)floor((max.y - origin.y) / cellSizeY);
+    z2 = (int)floor((max.z - origin.z) / cellSizeZ);
+
+    return x1 >= 0 && y1 >= 0 && z1 >= 0 &&
+        x2 < xLength && y2 < yLength && z2 < zLength;
+}
+
+bool GridAcc::update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed)
+{
+    // The cells keep their size, objects outside of the grid need a new one
+    int x1, y1, z1, x2, y2, z2;
+    for (unsigned int m = 0; m < added.size(); m++)
+    {
+        if (!getCellRange(added[m], x1, y1, z1, x2, y2, z2))
+            return false;
+    }
+
+    for (unsigned int m = 0; m < removed.size(); m++)
+    {
+        getCellRange(removed[m], x1, y1, z1, x2, y2, z2);
+        for (int i = std::max(x1, 0); i <= std::min(x2, xLength - 1); i++)
+        {
+            for (int j = std::max(y1, 0); j <= std::min(y2, yLength - 1); j++)
+            {
+                for (int k = std::max(z1, 0); k <= std::min(z2, zLength - 1); k++)
+                {
+                    std::vector<Geometry *> &cell = get(i, j, k);
+                    cell.erase(std::remove(cell.begin(), cell.end(), removed[m]), cell.end());
+                }
+            }
+        }
+    }
+
+    for (unsigned int m = 0; m < added.size(); m++)
+    {
+        getCellRange(added[m], x1, y1, z1, x2, y2, z2);
+        for (int i = x1; i <= x2; i++)
+        {
+            for (int j = y1; j <= y2; j++)
+            {
+                for (int k = z1; k <= z2; k++)
+                {
+                    get(i, j, k).push_back(added[m]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
 IntersectResult GridAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPoints)
 {
     Point near = origin;
@@ -18,10 +18,12 @@ private:
 private:
     std::vector<Geometry *> &get(int x, int y, int z);
     void getIndexInGrid(const Point &p, int &i, int &j, int&k);
+    bool getCellRange(const Geometry *g, int &x1, int &y1, int &z1, int &x2, int &y2, int &z2);
 
 public:
     GridAcc(std::vector<Geometry *> *scene) : Accelerator(scene) {}
     virtual void init();
+    virtual bool update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed);
     virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints);
 };
 
@@ -0,0 +1,231 @@
+#include "Heightfield.h"
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+
+Heightfield::Heightfield(const float *heights, int nx, int ny, double x0, double y0, double cellSize)
+    : x0(x0), y0(y0), cellSize(cellSize), nx(nx), ny(ny), heights(heights, heights + nx * ny)
+{
+    type = GeometryType::HEIGHTFIELD;
+    firstFacet = reserveIndexes((nx - 1) * (ny - 1));
+    buildPyramid();
+}
+
+void Heightfield::buildPyramid()
+{
+    // Level 0: the range of the four samples of each cell
+    int w = nx - 1;
+    int h = ny - 1;
+    levelWidth.push_back(w);
+    levelHeight.push_back(h);
+    minLevels.push_back(std::vector<float>(w * h));
+    maxLevels.push_back(std::vector<float>(w * h));
+
+    for (int j = 0; j < h; j++)
+    {
+        for (int i = 0; i < w; i++)
+        {
+            float a = height(i, j), b = height(i + 1, j);
+            float c = height(i, j + 1), d = height(i + 1, j + 1);
+            minLevels[0][j * w + i] = std::min(std::min(a, b), std::min(c, d));
+            maxLevels[0][j * w + i] = std::max(std::max(a, b), std::max(c, d));
+        }
+    }
+
+    // Upper levels: the range of 2 x 2 nodes of the level below
+    while (w > 1 || h > 1)
+    {
+        int pw = w, ph = h;
+        const std::vector<float> &pmin = minLevels.back();
+        const std::vector<float> &pmax = maxLevels.back();
+
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        std::vector<float> lmin(w * h, FLT_MAX);
+        std::vector<float> lmax(w * h, -FLT_MAX);
+
+        for (int j = 0; j < ph; j++)
+        {
+            for (int i = 0; i < pw; i++)
+            {
+                int k = (j / 2) * w + i / 2;
+                lmin[k] = std::min(lmin[k], pmin[j * pw + i]);
+                lmax[k] = std::max(lmax[k], pmax[j * pw + i]);
+            }
+        }
+
+        levelWidth.push_back(w);
+        levelHeight.push_back(h);
+        minLevels.push_back(lmin);
+        maxLevels.push_back(lmax);
+    }
+}
+
+Point Heightfield::getCenter() const
+{
+    int top = (int)minLevels.size() - 1;
+    return Point(
+        x0 + (nx - 1) * cellSize / 2,
+        y0 + (ny - 1) * cellSize / 2,
+        (minLevels[top][0] + maxLevels[top][0]) / 2.0);
+}
+
+void Heightfield::getBoundingBox(Point &min, Point &max) const
+{
+    int top = (int)minLevels.size() - 1;
+    min = Point(x0, y0, minLevels[top][0]);
+    max = Point(x0 + (nx - 1) * cellSize, y0 + (ny - 1) * cellSize, maxLevels[top][0]);
+}
+
+// The part [t0, t1] of the ray over the rectangle, returns false if it misses
+bool Heightfield::clip(const Ray &ray, double xMin, double yMin, double xMax, double yMax, double &t0, double &t1) const
+{
+    double lo[2] = { xMin, yMin };
+    double hi[2] = { xMax, yMax };
+    for (int axis = 0; axis < 2; axis++)
+    {
+        double o = ray.origin[axis];
+        double d = ray.direction[axis];
+        if (fabs(d) < 1e-12)
+        {
+            if (o < lo[axis] || o > hi[axis])
+                return false;
+            continue;
+        }
+        double ta = (lo[axis] - o) / d;
+        double tb = (hi[axis] - o) / d;
+        if (ta > tb)
+            std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    return t0 <= t1;
+}
+
+// Visit the node (i, j) of the level, and its children in the order along the ray
+bool Heightfield::traverse(const Ray &ray, int level, int i, int j, double t0, double t1, IntersectResult &result) const
+{
+    double size = cellSize * (1 << level);
+    if (!clip(ray, x0 + i * size, y0 + j * size, x0 + (i + 1) * size, y0 + (j + 1) * size, t0, t1))
+        return false;
+
+    // Skip the node if the ray stays above or below it
+    double z0 = ray.origin.z + ray.direction.z * t0;
+    double z1 = ray.origin.z + ray.direction.z * t1;
+    int k = j * levelWidth[level] + i;
+    if (std::min(z0, z1) > maxLevels[level][k] || std::max(z0, z1) < minLevels[level][k])
+        return false;
+
+    if (level == 0)
+        return intersectCell(ray, i, j, t0, t1, result);
+
+    // Children in the order the ray passes them (the near x and y halves first)
+    int ci[4], cj[4];
+    int fx = ray.direction.x < 0 ? 1 : 0;
+    int fy = ray.direction.y < 0 ? 1 : 0;
+    bool xFirst = fabs(ray.direction.x) >= fabs(ray.direction.y);
+    for (int n = 0; n < 4; n++)
+    {
+        int a = xFirst ? (n & 1) : (n >> 1);
+        int b = xFirst ? (n >> 1) : (n & 1);
+        ci[n] = i * 2 + (a ^ fx);
+        cj[n] = j * 2 + (b ^ fy);
+    }
+
+    // The children are not strictly ordered, so keep the nearest hit of all of them
+    bool hit = false;
+    for (int n = 0; n < 4; n++)
+    {
+        if (ci[n] >= levelWidth[level - 1] || cj[n] >= levelHeight[level - 1])
+            continue;
+        if (traverse(ray, level - 1, ci[n], cj[n], t0, hit ? std::min(t1, result.distance) : t1, result))
+            hit = true;
+    }
+    return hit;
+}
+
+// Intersect the bilinear patch of a cell in [t0, t1]
+bool Heightfield::intersectCell(const Ray &ray, int i, int j, double t0, double t1, IntersectResult &result) const
+{
+    // h(u, v) = a + b * u + c * v + d * u * v with u, v in [0, 1]
+    double h00 = height(i, j), h10 = height(i + 1, j);
+    double h01 = height(i, j + 1), h11 = height(i + 1, j + 1);
+    double a = h00;
+    double b = h10 - h00;
+    double c = h01 - h00;
+    double d = h00 - h10 - h01 + h11;
+
+    // The ray in cell coordinates: u = u0 + du * t, v = v0 + dv * t
+    double u0 = (ray.origin.x - (x0 + i * cellSize)) / cellSize;
+    double v0 = (ray.origin.y - (y0 + j * cellSize)) / cellSize;
+    double du = ray.direction.x / cellSize;
+    double dv = ray.direction.y / cellSize;
+
+    // z(t) - h(u(t), v(t)) = A * t^2 + B * t + C = 0
+    double A = -d * du * dv;
+    double B = ray.direction.z - b * du - c * dv - d * (u0 * dv + v0 * du);
+    double C = ray.origin.z - a - b * u0 - c * v0 - d * u0 * v0;
+
+    double roots[2];
+    int n = 0;
+    if (fabs(A) < 1e-12)
+    {
+        if (fabs(B) > 1e-12)
+            roots[n++] = -C / B;
+    }
+    else
+    {
+        double delta = B * B - 4 * A * C;
+        if (delta >= 0)
+        {
+            double q = -0.5 * (B + (B >= 0 ? sqrt(delta) : -sqrt(delta)));
+            roots[n++] = q / A;
+            if (q != 0)
+                roots[n++] = C / q;
+            if (n == 2 && roots[1] < roots[0])
+                std::swap(roots[0], roots[1]);
+        }
+    }
+
+    const double eps = 1e-9;
+    for (int r = 0; r < n; r++)
+    {
+        double t = roots[r];
+        if (t < 0.0005f || t < t0 - eps || t > t1 + eps)
+            continue;
+
+        double u = std::min(std::max(u0 + du * t, 0.0), 1.0);
+        double v = std::min(std::max(v0 + dv * t, 0.0), 1.0);
+        double hx = (b + d * v) / cellSize; // dh/dx
+        double hy = (c + d * u) / cellSize; // dh/dy
+
+        result.hit = true;
+        result.geometry = (Geometry *)this;
+        result.facet = firstFacet + j * (nx - 1) + i;
+        result.material = material;
+        result.distance = t;
+        result.position = ray.getPoint(t);
+        result.normal = Vector(-hx, -hy, 1).norm(); // points up (to the outside)
+        return true;
+    }
+    return false;
+}
+
+unsigned int Heightfield::hash(unsigned int seed) const
+{
+    double grid[3] = { x0, y0, cellSize };
+    int size[2] = { nx, ny };
+    seed = hashBytes(seed, grid, sizeof(grid));
+    seed = hashBytes(seed, size, sizeof(size));
+    seed = hashBytes(seed, &heights[0], (int)(heights.size() * sizeof(float)));
+    return hashBytes(seed, &material, sizeof(material));
+}
+
+IntersectResult Heightfield::intersect(Ray &ray)
+{
+    IntersectResult result(false);
+
+    int top = (int)minLevels.size() - 1;
+    traverse(ray, top, 0, 0, 0, DBL_MAX, result);
+    return result;
+}
@@ -0,0 +1,47 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <vector>
+#include "Geometry.h"
+
+// Terrain given by a regular raster of elevation samples
+//
+// Sample (i, j) is at (x0 + i * cellSize, y0 + j * cellSize, heights[j * nx + i]),
+// and each cell between four samples is a bilinear patch. A min/max pyramid
+// over the cells lets a ray skip whole blocks of cells that it passes above
+// or below. Every cell is a facet with its own index, so reflection paths on
+// the terrain are told apart like paths on triangles.
+class Heightfield : public Geometry
+{
+private:
+    double x0;
+    double y0;
+    double cellSize;
+    int nx; // samples in x
+    int ny; // samples in y
+    std::vector<float> heights;
+
+    // Min/max pyramid: level 0 is the cells, level L covers 2^L x 2^L cells
+    std::vector<int> levelWidth;
+    std::vector<int> levelHeight;
+    std::vector<std::vector<float> > minLevels;
+    std::vector<std::vector<float> > maxLevels;
+
+    int firstFacet; // Geometry::index of cell 0
+
+private:
+    float height(int i, int j) const { return heights[j * nx + i]; }
+    void buildPyramid();
+    bool clip(const Ray &ray, double xMin, double yMin, double xMax, double yMax, double &t0, double &t1) const;
+    bool traverse(const Ray &ray, int level, int i, int j, double t0, double t1, IntersectResult &result) const;
+    bool intersectCell(const Ray &ray, int i, int j, double t0, double t1, IntersectResult &result) const;
+
+public:
+    Heightfield(const float *heights, int nx, int ny, double x0, double y0, double cellSize);
+    virtual Point getCenter() const;
+    virtual void getBoundingBox(Point &min, Point &max) const;
+    virtual IntersectResult intersect(Ray &ray);
+    virtual unsigned int hash(unsigned int seed) const;
+};
+
+#endif
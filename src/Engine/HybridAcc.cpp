@@ -0,0 +1,301 @@
+#include "HybridAcc.h"
+#include "Grid.h"
+#include "Sphere.h"
+#include "Utils.h"
+
+#include <thread>
+#include <map>
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+
+HybridAcc::~HybridAcc()
+{
+    clear();
+}
+
+void HybridAcc::clear()
+{
+    for (unsigned int i = 0; i < trees.size(); i++)
+    {
+        delete trees[i];
+    }
+    trees.clear();
+    objects.clear();
+}
+
+void HybridAcc::buildTreesThread(HybridAcc *acc, const std::vector<int> *cells, std::atomic<int> *next, int node)
+{
+    if (node >= 0) // the trees are allocated on the node of the trace thread
+        Utils::PinThread(node);
+
+    int n = (int)cells->size();
+    int k;
+    while ((k = (*next)++) < n)
+    {
+        int i = (*cells)[k];
+        delete acc->trees[i];
+        acc->trees[i] = NULL;
+        if (acc->objects[i].empty())
+            continue;
+
+        int leaves = 0;
+        int leafElements = 0;
+        acc->trees[i] = new KdTreeAcc(&acc->objects[i]);
+        acc->trees[i]->build(leaves, leafElements);
+    }
+}
+
+void HybridAcc::buildTrees(const std::vector<int> &cells)
+{
+    int nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, std::max(1, (int)cells.size()));
+    int node = Utils::GetPinnedNumaNode();
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers.push_back(std::thread(buildTreesThread, this, &cells, &next, node));
+    }
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers[i].join();
+    }
+}
+
+void HybridAcc::getCellRange(const Geometry *g, int &x1, int &y1, int &x2, int &y2) const
+{
+    Point min, max;
+    g->getBoundingBox(min, max);
+    x1 = std::max(0, std::min(xLength - 1, (int)floor((min.x - origin.x) / cellSizeX)));
+    x2 = std::max(0, std::min(xLength - 1, (int)floor((max.x - origin.x) / cellSizeX)));
+    y1 = std::max(0, std::min(yLength - 1, (int)floor((min.y - origin.y) / cellSizeY)));
+    y2 = std::max(0, std::min(yLength - 1, (int)floor((max.y - origin.y) / cellSizeY)));
+}
+
+void HybridAcc::init()
+{
+    Utils::PrintTime("Initialize hybrid grid");
+    clear();
+
+    // 1. Get the range of the objects
+    sceneMin = Point(DBL_MAX, DBL_MAX, DBL_MAX);
+    sceneMax = Point(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+    for (unsigned int i = 0; i < scene->size(); i++)
+    {
+        Point min, max;
+        (*scene)[i]->getBoundingBox(min, max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            sceneMin[axis] = std::min(sceneMin[axis], min[axis]);
+            sceneMax[axis] = std::max(sceneMax[axis], max[axis]);
+        }
+    }
+    if (scene->empty())
+    {
+        sceneMin = Point(0, 0, 0);
+        sceneMax = Point(0, 0, 0);
+    }
+
+    // 2. Square cells of about ObjectsPerCell objects (for evenly spread objects)
+    double width = sceneMax.x - sceneMin.x;
+    double height = sceneMax.y - sceneMin.y;
+    double cells = std::max(1.0, (double)scene->size() / ObjectsPerCell);
+    double size = sqrt(width * height / cells);
+    if (!(size > 0))
+        size = std::max(std::max(width, height), 1.0);
+    size = std::max(size, std::max(width, height) / MaxCellsPerAxis);
+
+    origin = sceneMin;
+    cellSizeX = size;
+    cellSizeY = size;
+    xLength = std::max(1, (int)ceil(width / size));
+    yLength = std::max(1, (int)ceil(height / size));
+
+    // 3. Put the objects into the cells their bounding boxes overlap
+    objects.resize(xLength * yLength);
+    trees.assign(xLength * yLength, NULL);
+    for (unsigned int i = 0; i < scene->size(); i++)
+    {
+        int x1, y1, x2, y2;
+        getCellRange((*scene)[i], x1, y1, x2, y2);
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                objects[y * xLength + x].push_back((*scene)[i]);
+            }
+        }
+    }
+
+    // 4. Build the trees of the cells in parallel
+    std::vector<int> all(xLength * yLength);
+    for (int i = 0; i < xLength * yLength; i++)
+    {
+        all[i] = i;
+    }
+    buildTrees(all);
+    builtObjects = (int)scene->size();
+    builtCounts.resize(xLength * yLength);
+    for (int i = 0; i < xLength * yLength; i++)
+    {
+        builtCounts[i] = (int)objects[i].size();
+    }
+
+    Utils::DbgPrint("Hybrid Grid Size: %d x %d\n", xLength, yLength);
+}
+
+// The cells keep their size, the grid is rebuilt when an object sticks out of
+// the scene box, when the scene has grown or shrunk by half since the last
+// build, or when a cell has grown by more than the objects it was made for.
+bool HybridAcc::update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed)
+{
+    if (trees.empty())
+        return false;
+
+    int n = (int)scene->size();
+    if (n > builtObjects * 3 / 2 || n < builtObjects / 2)
+        return false;
+
+    for (unsigned int i = 0; i < added.size(); i++)
+    {
+        Point min, max;
+        added[i]->getBoundingBox(min, max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (min[axis] < sceneMin[axis] || max[axis] > sceneMax[axis])
+                return false;
+        }
+    }
+
+    std::vector<bool> dirty(xLength * yLength, false);
+    for (unsigned int i = 0; i < removed.size(); i++)
+    {
+        int x1, y1, x2, y2;
+        getCellRange(removed[i], x1, y1, x2, y2);
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                std::vector<Geometry *> &cell = objects[y * xLength + x];
+                cell.erase(std::remove(cell.begin(), cell.end(), removed[i]), cell.end());
+                dirty[y * xLength + x] = true;
+            }
+        }
+    }
+    for (unsigned int i = 0; i < added.size(); i++)
+    {
+        int x1, y1, x2, y2;
+        getCellRange(added[i], x1, y1, x2, y2);
+        for (int y = y1; y <= y2; y++)
+        {
+            for (int x = x1; x <= x2; x++)
+            {
+                objects[y * xLength + x].push_back(added[i]);
+                dirty[y * xLength + x] = true;
+            }
+        }
+    }
+
+    // Rebuild the trees of the edited cells
+    std::vector<int> cells;
+    for (int i = 0; i < xLength * yLength; i++)
+    {
+        if (!dirty[i])
+            continue;
+        if ((int)objects[i].size() > builtCounts[i] + ObjectsPerCell)
+            return false;
+        cells.push_back(i);
+    }
+    buildTrees(cells);
+
+    Utils::DbgPrint("Hybrid Grid: %d of %d cells rebuilt\n", (int)cells.size(), xLength * yLength);
+    return true;
+}
+
+IntersectResult HybridAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPoints)
+{
+    // Clip the ray to the scene
+    double entry, exit;
+    Grid sceneBox(sceneMin, sceneMax);
+    if (trees.empty() || !sceneBox.intersect(ray, entry, exit))
+        return IntersectResult(false);
+    double t = std::max(entry, 0.0);
+
+    // 2D DDA through the columns
+    Point p = ray.getPoint(t);
+    int x = std::max(0, std::min(xLength - 1, (int)floor((p.x - origin.x) / cellSizeX)));
+    int y = std::max(0, std::min(yLength - 1, (int)floor((p.y - origin.y) / cellSizeY)));
+
+    int stepX = ray.direction.x > 0 ? 1 : -1;
+    int stepY = ray.direction.y > 0 ? 1 : -1;
+    double tMaxX = DBL_MAX, tDeltaX = DBL_MAX;
+    double tMaxY = DBL_MAX, tDeltaY = DBL_MAX;
+    if (ray.direction.x != 0)
+    {
+        tMaxX = (origin.x + (x + (stepX > 0 ? 1 : 0)) * cellSizeX - ray.origin.x) / ray.direction.x;
+        tDeltaX = cellSizeX / fabs(ray.direction.x);
+    }
+    if (ray.direction.y != 0)
+    {
+        tMaxY = (origin.y + (y + (stepY > 0 ? 1 : 0)) * cellSizeY - ray.origin.y) / ray.direction.y;
+        tDeltaY = cellSizeY / fabs(ray.direction.y);
+    }
+
+    std::map<int, RxSphereInfo> rxIntersections; // spheres may be found in several cells
+    std::vector<RxIntersection> cellRxPoints;
+    IntersectResult result(false);
+
+    while (true)
+    {
+        double cellExit = std::min(tMaxX, tMaxY);
+
+        KdTreeAcc *tree = trees[y * xLength + x];
+        if (tree != NULL)
+        {
+            cellRxPoints.clear();
+            IntersectResult r = tree->KdTreeAcc::intersect(ray, cellRxPoints);
+            for (unsigned int i = 0; i < cellRxPoints.size(); i++)
+            {
+                RxSphereInfo &info = rxIntersections[cellRxPoints[i].index];
+                info.distance = cellRxPoints[i].distance;
+                info.offset = cellRxPoints[i].offset;
+                info.radius = cellRxPoints[i].radius;
+            }
+
+            // A hit behind the column is found again by the tree of its own column
+            if (r.hit && r.distance <= cellExit + 1e-6)
+            {
+                result = r;
+                break;
+            }
+        }
+
+        // Next column
+        if (cellExit > exit)
+            break;
+        if (tMaxX < tMaxY)
+        {
+            x += stepX;
+            tMaxX += tDeltaX;
+        }
+        else
+        {
+            y += stepY;
+            tMaxY += tDeltaY;
+        }
+        if (x < 0 || x >= xLength || y < 0 || y >= yLength)
+            break;
+    }
+
+    std::map<int, RxSphereInfo>::iterator it;
+    for (it = rxIntersections.begin(); it != rxIntersections.end(); ++it)
+    {
+        if (!result.hit || it->second.distance < result.distance)
+        {
+            rxPoints.push_back(
+                RxIntersection(it->first, it->second.distance, it->second.offset, it->second.radius));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,51 @@
+#ifndef HYBRID_ACC_H
+#define HYBRID_ACC_H
+
+#include <atomic>
+#include "Accelerator.h"
+#include "KdTreeAcc.h"
+
+// Coarse 2D grid (x, y) of small kd-trees, for large and flat scenes
+//
+// Every cell holds the objects whose bounding boxes overlap its column and a
+// kd-tree of them. The trees are built independently on all cores. A ray
+// walks the columns it crosses (2D DDA) and asks the tree of each one, a hit
+// counts only when it lies inside the column, otherwise the ray goes on to the
+// next column (objects crossing a column border are in both trees). A scene
+// edit only rebuilds the trees of the columns it touches.
+class HybridAcc : public Accelerator
+{
+private:
+    Point origin;
+    double cellSizeX;
+    double cellSizeY;
+    int xLength;
+    int yLength;
+    Point sceneMin;
+    Point sceneMax;
+
+    std::vector<std::vector<Geometry *> > objects; // per cell
+    std::vector<KdTreeAcc *> trees; // per cell, NULL for empty cells
+
+    static const int ObjectsPerCell = 2048; // target of the cell size
+    static const int MaxCellsPerAxis = 256;
+
+private:
+    int builtObjects; // scene size at the last full build
+    std::vector<int> builtCounts; // per cell, at the last full build
+
+    void clear();
+    void getCellRange(const Geometry *g, int &x1, int &y1, int &x2, int &y2) const;
+    void buildTrees(const std::vector<int> &cells); // in parallel
+    static void buildTreesThread(HybridAcc *acc, const std::vector<int> *cells, std::atomic<int> *next, int node);
+
+public:
+    HybridAcc(std::vector<Geometry *> *scene)
+        : Accelerator(scene), xLength(0), yLength(0), builtObjects(0) {}
+    ~HybridAcc();
+    virtual void init();
+    virtual bool update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed);
+    virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints);
+};
+
+#endif
@@ -32,6 +32,8 @@ struct IntersectResult
 {
     bool      hit;
     Geometry* geometry;
+    int       facet; // Geometry::index of the facet (a heightfield has one per cell)
+    int       material; // material ID of the facet
     double    distance;
     Point     position;
 
@@ -45,6 +47,8 @@ struct IntersectResult
     IntersectResult(bool hit)
     {
         this->hit = hit; 
+        this->facet = 0;
+        this->material = 0;
     }
 };
 
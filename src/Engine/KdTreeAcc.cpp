@@ -4,10 +4,24 @@
 #include "Utils.h"
 
 #include <algorithm>
+#include <float.h>
+
+// Count the primitive tests of the leaves, and the redundant ones (tests of a
+// primitive the ray has tested before, found exactly, with or without the
+// mailbox)
+#define MAILBOX_STATS 0
+#define USE_MAILBOX 1
+
+#if MAILBOX_STATS
+static long long leafTests = 0;
+static long long redundantTests = 0;
+static long long mailboxSkips = 0;
+#endif
 
 KdTreeAcc::~KdTreeAcc()
 {
-    deleteTree(root);
+    if (root != NULL)
+        deleteTree(root);
 }
 
 bool cmpGeometryXAxis(const Geometry *g1, const Geometry *g2)
@@ -295,6 +309,17 @@ void KdTreeAcc::init()
 {
     Utils::PrintTime("Initialize k-d tree");
 
+    int leaves = 0;
+    int leafElements = 0;
+    build(leaves, leafElements);
+    Utils::DbgPrint("Total leaves: %d\r\n", leaves);
+    Utils::DbgPrint("Average Leaf Size: %d\r\n", leafElements / leaves);
+}
+
+void KdTreeAcc::build(int &leaves, int &leafElements)
+{
+    if (root != NULL) // built before
+        deleteTree(root);
     root = new KdNode();
 
     // Copy list
@@ -322,11 +347,102 @@ void KdTreeAcc::init()
     root->max = Point(max_x, max_y, max_z);
 
     // Build the tree
-    int leaves = 0;
-    int leafElements = 0;
     buildKdTree(root, list, 0, leaves, leafElements);
-    Utils::DbgPrint("Total leaves: %d\r\n", leaves);
-    Utils::DbgPrint("Average Leaf Size: %d\r\n", leafElements / leaves);
+    builtReferences = leafElements;
+    references = leafElements;
+}
+
+// Same sides as in buildKdTree(), decided by the bounding box
+void KdTreeAcc::removeObject(KdNode *node, Geometry *object, const Point &min, const Point &max)
+{
+    if (node->axis == NoAxis)
+    {
+        std::vector<Geometry *>::iterator it = std::find(node->list.begin(), node->list.end(), object);
+        if (it != node->list.end())
+        {
+            node->list.erase(it);
+            references -= 1;
+        }
+        return;
+    }
+
+    if (min[node->axis] < node->splitPlane)
+        removeObject(node->left, object, min, max);
+    if (max[node->axis] >= node->splitPlane)
+        removeObject(node->right, object, min, max);
+}
+
+void KdTreeAcc::insertObject(KdNode *node, Geometry *object, const Point &min, const Point &max,
+    int depth, std::vector<std::pair<KdNode *, int> > &touched)
+{
+    if (node->axis == NoAxis)
+    {
+        node->list.push_back(object);
+        references += 1;
+        touched.push_back(std::make_pair(node, depth));
+        return;
+    }
+
+    if (min[node->axis] < node->splitPlane)
+        insertObject(node->left, object, min, max, depth + 1, touched);
+    if (max[node->axis] >= node->splitPlane)
+        insertObject(node->right, object, min, max, depth + 1, touched);
+}
+
+// Objects are removed from / inserted into the leaves they overlap, and the
+// leaves grown too large are split again, as subtrees of their own objects.
+// The tree is rebuilt when an object sticks out of the root box, or when the
+// leaf references have doubled since the last build (the splits above the
+// leaves no longer fit the scene).
+bool KdTreeAcc::update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed)
+{
+    if (root == NULL)
+        return false;
+
+    for (unsigned int i = 0; i < added.size(); i++)
+    {
+        Point min, max;
+        added[i]->getBoundingBox(min, max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (min[axis] < root->min[axis] || max[axis] > root->max[axis])
+                return false;
+        }
+    }
+
+    for (unsigned int i = 0; i < removed.size(); i++)
+    {
+        Point min, max;
+        removed[i]->getBoundingBox(min, max);
+        removeObject(root, removed[i], min, max);
+    }
+
+    std::vector<std::pair<KdNode *, int> > touched; // leaves and their depths
+    for (unsigned int i = 0; i < added.size(); i++)
+    {
+        Point min, max;
+        added[i]->getBoundingBox(min, max);
+        insertObject(root, added[i], min, max, 0, touched);
+    }
+
+    if (references > 2 * std::max(builtReferences, 64))
+        return false;
+
+    // Split the leaves again (a leaf is in the list once per inserted object)
+    for (unsigned int i = 0; i < touched.size(); i++)
+    {
+        KdNode *node = touched[i].first;
+        if (node->axis != NoAxis || node->list.size() <= 16)
+            continue;
+
+        std::vector<Geometry *> list;
+        list.swap(node->list);
+        int leaves = 0;
+        int leafElements = 0;
+        buildKdTree(node, list, touched[i].second, leaves, leafElements);
+        references += leafElements - (int)list.size();
+    }
+    return true;
 }
 
 // The recursive ray traversal algorithm TA_rec_B for the k-d tree
@@ -369,6 +485,15 @@ IntersectResult KdTreeAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPo
 
     std::map<int, RxSphereInfo> rxIntersections;
 
+    MailboxEntry mailbox[MailboxSize];
+    for (int i = 0; i < MailboxSize; i++)
+    {
+        mailbox[i].geometry = NULL;
+    }
+#if MAILBOX_STATS
+    std::vector<const Geometry *> tested;
+#endif
+
     // Loop, traverse through the whole kd-tree
     while (currNode != NULL)
     {
@@ -441,7 +566,35 @@ IntersectResult KdTreeAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPo
 
         for (unsigned int i = 0; i < currNode->list.size(); i++)
         {
-            IntersectResult result = currNode->list[i]->intersect(ray);
+            Geometry *g = currNode->list[i];
+            MailboxEntry &entry = mailbox[g->index & (MailboxSize - 1)];
+#if USE_MAILBOX
+            // Tested in a previous leaf: a miss stays a miss, a hit outside this
+            // leaf is skipped, a hit inside is tested again (same result)
+            if (entry.geometry == g &&
+                (entry.distance == DBL_MAX ||
+                 entry.distance < stack[enPt].t - 0.001f ||
+                 entry.distance > stack[exPt].t + 0.001f))
+            {
+#if MAILBOX_STATS
+                mailboxSkips += 1;
+#endif
+                continue;
+            }
+#endif
+            entry.geometry = g;
+            entry.distance = DBL_MAX;
+
+#if MAILBOX_STATS
+            leafTests += 1;
+            if (std::find(tested.begin(), tested.end(), g) != tested.end())
+                redundantTests += 1;
+            else
+                tested.push_back(g);
+#endif
+            IntersectResult result = g->intersect(ray);
+            if (result.hit)
+                entry.distance = result.distance;
             if (result.hit &&
                 result.distance >= stack[enPt].t - 0.001f && 
                 result.distance <= stack[exPt].t + 0.001f)
@@ -501,3 +654,17 @@ IntersectResult KdTreeAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPo
     // currNode = NULL, ray leaves the scene
     return IntersectResult(false);
 }
+
+void KdTreeAcc::PrintTestStats()
+{
+#if MAILBOX_STATS
+    if (leafTests + mailboxSkips == 0)
+        return;
+
+    fprintf(stderr, "    Kd-tree leaf tests: %lld, redundant %lld (%.2lf%%), skipped by the mailbox %lld\n",
+        leafTests, redundantTests, 100.0 * redundantTests / std::max(leafTests, 1LL), mailboxSkips);
+    leafTests = 0;
+    redundantTests = 0;
+    mailboxSkips = 0;
+#endif
+}
@@ -22,6 +22,20 @@ private:
     };
     KdNode *root;
 
+    // Leaf references at the last full build and now (see update())
+    int builtReferences;
+    int references;
+
+    // Mailbox of the primitives tested by one ray (direct mapped by
+    // Geometry::index): a primitive straddling split planes is in several
+    // leaves along the ray, its first test decides the others
+    struct MailboxEntry
+    {
+        const Geometry *geometry;
+        double distance; // of the hit, DBL_MAX for a miss (or occluded)
+    };
+    static const int MailboxSize = 64; // power of two
+
     struct StackElem
     {
         KdNode *node;  // pointer of far child
@@ -46,12 +60,22 @@ private:
     void deleteTree(KdNode *node);
     double split(KdNode *node, int axis, std::vector<Geometry *> &list);
     double splitSAH(KdNode *node, std::vector<Geometry *> &list, int &bestAxis, double &minSAH);
+    void removeObject(KdNode *node, Geometry *object, const Point &min, const Point &max);
+    void insertObject(KdNode *node, Geometry *object, const Point &min, const Point &max,
+        int depth, std::vector<std::pair<KdNode *, int> > &touched);
 
 public:
-    KdTreeAcc(std::vector<Geometry *> *scene) : Accelerator(scene) {}
+    KdTreeAcc(std::vector<Geometry *> *scene)
+        : Accelerator(scene), root(NULL), builtReferences(0), references(0) {}
     ~KdTreeAcc();
     virtual void init();
+    void build(int &leaves, int &leafElements); // init() without logging (thread safe)
+    virtual bool update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed);
     virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints);
+
+    // Primitive tests of the leaves since the last call, and the redundant
+    // ones (MAILBOX_STATS builds only, see KdTreeAcc.cpp)
+    static void PrintTestStats();
 };
 
 #endif
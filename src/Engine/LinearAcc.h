@@ -8,6 +8,7 @@ class LinearAcc : public Accelerator
 public:
     LinearAcc(std::vector<Geometry *> *scene) : Accelerator(scene) {}
     virtual void init();
+    virtual bool update(const std::vector<Geometry *> & /* added */, const std::vector<Geometry *> & /* removed */) { return true; }
     virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints);
 };
 
@@ -0,0 +1,186 @@
+#include "MeshSanitizer.h"
+
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <math.h>
+#include <float.h>
+
+static bool finite_point(const Point &p)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (!(fabs(p[i]) <= DBL_MAX)) // false for NaN too
+            return false;
+    }
+    return true;
+}
+
+void MeshSanitizer::checkThread(std::vector<Triangle *> *triangles, std::vector<Face> *faces, int first, int last)
+{
+    for (int i = first; i < last; i++)
+    {
+        Triangle *t = (*triangles)[i];
+        Face &face = (*faces)[i];
+        face.degenerate = false;
+        face.duplicate = false;
+        face.normal = 0;
+        face.hash = 0;
+
+        if (!finite_point(t->a) || !finite_point(t->b) || !finite_point(t->c))
+        {
+            face.degenerate = true;
+            continue;
+        }
+
+        // Twice the area, and the longest edge for the slivers
+        Vector cross = Vector(t->a, t->b).cross(Vector(t->a, t->c));
+        double area2 = cross.length();
+        double edge2 = std::max(Vector(t->a, t->b).dot(Vector(t->a, t->b)),
+            std::max(Vector(t->b, t->c).dot(Vector(t->b, t->c)), Vector(t->c, t->a).dot(Vector(t->c, t->a))));
+        if (area2 < 1e-10 || area2 < 1e-9 * edge2)
+        {
+            face.degenerate = true;
+            continue;
+        }
+        Vector geometric = cross * (1.0 / area2);
+
+        // Normal
+        double length = t->normal.length();
+        if (!(length > 1e-6 && length <= DBL_MAX))
+        {
+            face.normal = 1;
+            t->normal = geometric;
+        }
+        else
+        {
+            double cosine = t->normal.dot(geometric) / length;
+            if (cosine < -0.9)
+            {
+                face.normal = 2;
+                t->normal = geometric;
+            }
+            else if (cosine < 0.9)
+            {
+                face.normal = 1;
+                t->normal = geometric;
+            }
+            else if (fabs(length - 1) > 1e-6)
+            {
+                t->normal = t->normal * (1.0 / length);
+            }
+        }
+
+        // Key of the vertex set (0.1 mm)
+        long long v[3][3];
+        const Point *p[3] = { &t->a, &t->b, &t->c };
+        for (int k = 0; k < 3; k++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                v[k][axis] = (long long)floor((*p[k])[axis] * 10000.0 + 0.5);
+            }
+        }
+        struct VertexLess
+        {
+            bool operator()(const long long *x, const long long *y) const
+            {
+                return x[0] < y[0] || (x[0] == y[0] && (x[1] < y[1] || (x[1] == y[1] && x[2] < y[2])));
+            }
+        };
+        const long long *sorted[3] = { v[0], v[1], v[2] };
+        std::sort(sorted, sorted + 3, VertexLess());
+
+        unsigned long long h = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                face.key[k * 3 + axis] = sorted[k][axis];
+                h = h * 0x9E3779B97F4A7C15ULL + (unsigned long long)sorted[k][axis];
+            }
+        }
+        face.hash = (std::size_t)(h ^ (h >> 32));
+    }
+}
+
+void MeshSanitizer::dedupThread(std::vector<Face> *faces, int shard, int nShards)
+{
+    // The first face of every key (in the input order) of this shard
+    std::unordered_multimap<std::size_t, int> seen;
+    for (int i = 0; i < (int)faces->size(); i++)
+    {
+        Face &face = (*faces)[i];
+        if (face.degenerate || (int)(face.hash % nShards) != shard)
+            continue;
+
+        std::pair<std::unordered_multimap<std::size_t, int>::iterator,
+                  std::unordered_multimap<std::size_t, int>::iterator> range = seen.equal_range(face.hash);
+        for (std::unordered_multimap<std::size_t, int>::iterator it = range.first; it != range.second; ++it)
+        {
+            if (std::equal(face.key, face.key + 9, (*faces)[it->second].key))
+            {
+                face.duplicate = true;
+                break;
+            }
+        }
+        if (!face.duplicate)
+            seen.insert(std::make_pair(face.hash, i));
+    }
+}
+
+void MeshSanitizer::Sanitize(std::vector<Triangle *> &triangles, Stats &stats)
+{
+    int n = (int)triangles.size();
+    stats.input = n;
+    stats.degenerate = 0;
+    stats.duplicates = 0;
+    stats.fixedNormals = 0;
+    stats.flippedNormals = 0;
+    if (n == 0)
+        return;
+
+    std::vector<Face> faces(n);
+    int nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, std::max(1, n / 4096));
+
+    // 1. Check the triangles, fix the normals, make the keys
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers.push_back(std::thread(checkThread, &triangles, &faces,
+            (int)((long long)n * i / nThreads), (int)((long long)n * (i + 1) / nThreads)));
+    }
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers[i].join();
+    }
+
+    // 2. Find the duplicates
+    workers.clear();
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers.push_back(std::thread(dedupThread, &faces, i, nThreads));
+    }
+    for (int i = 0; i < nThreads; i++)
+    {
+        workers[i].join();
+    }
+
+    // 3. Compact
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (faces[i].degenerate || faces[i].duplicate)
+        {
+            stats.degenerate += faces[i].degenerate ? 1 : 0;
+            stats.duplicates += faces[i].duplicate ? 1 : 0;
+            delete triangles[i];
+            continue;
+        }
+        stats.fixedNormals += (faces[i].normal == 1) ? 1 : 0;
+        stats.flippedNormals += (faces[i].normal == 2) ? 1 : 0;
+        triangles[kept++] = triangles[i];
+    }
+    triangles.resize(kept);
+}
@@ -0,0 +1,50 @@
+#ifndef MESH_SANITIZER_H
+#define MESH_SANITIZER_H
+
+#include <vector>
+#include "Triangle.h"
+
+// Cleans a loaded mesh before the accelerators are built over it
+//
+// - Degenerate triangles (zero area, slivers, non-finite vertices) are removed:
+//   they are never hit (see Triangle::intersect()) but cost tests in every leaf.
+// - Duplicate triangles (the same three vertices within 0.1 mm, in any order
+//   or winding) are removed, the first one is kept.
+// - Invalid normals (zero, non-finite, not perpendicular to the face, or not
+//   agreeing with the counter-clockwise winding) are recomputed from the
+//   vertices, the others are normalized.
+//
+// The triangles are checked in parallel, the duplicates are found in parallel
+// too (every thread owns the hash keys of one shard), so the result does not
+// depend on the number of threads.
+class MeshSanitizer
+{
+public:
+    struct Stats
+    {
+        int input;
+        int degenerate;   // removed
+        int duplicates;   // removed
+        int fixedNormals; // zero, non-finite or not perpendicular
+        int flippedNormals;
+    };
+
+private:
+    struct Face
+    {
+        long long key[9]; // quantized vertices, sorted
+        std::size_t hash;
+        bool degenerate;
+        bool duplicate;
+        int normal;       // 0 = valid, 1 = fixed, 2 = flipped
+    };
+
+    static void checkThread(std::vector<Triangle *> *triangles, std::vector<Face> *faces, int first, int last);
+    static void dedupThread(std::vector<Face> *faces, int shard, int nShards);
+
+public:
+    // Removes (and deletes) the bad triangles, keeps the order of the others
+    static void Sanitize(std::vector<Triangle *> &triangles, Stats &stats);
+};
+
+#endif
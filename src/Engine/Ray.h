@@ -17,6 +17,13 @@ struct RayPath
     static const unsigned int I = 17; // a small prime number
     static const unsigned int P = 486187739; // a big prime number
 
+    // Point tags: a reflection is the Geometry::index of the facet (> 0), a
+    // diffraction is negative, a transmission has the TransmissionTag bit set
+    // (the facet indexes stay below it), so the three never collide
+    static const int TransmissionTag = 0x40000000;
+    static int diffraction(int edge) { return -1 - edge; }
+    static int transmission(int facet) { return facet | TransmissionTag; }
+
     RayPath();
     void addPoint(int index); // add a point to the reflection path
 };
@@ -41,6 +48,7 @@ struct Ray
     enum RayState { Start, FirstReflect, MoreReflect } state;
     double prev_mileage;
     Point  prev_point;
+    Vector departure; // direction of the path leaving the tx point
 
     // reflection path
     RayPath path;
@@ -50,7 +58,7 @@ struct Ray
 
     Ray(const Point &origin, const Vector &direction, double unitSurfaceArea) 
         : origin(origin), direction(direction), unit_surface_area(unitSurfaceArea),
-          state(Start), prev_mileage(0), prev_point(origin)
+          state(Start), prev_mileage(0), prev_point(origin), departure(direction)
     {
     }
 
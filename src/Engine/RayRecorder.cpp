@@ -0,0 +1,278 @@
+#include "RayRecorder.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+RayRecorder::RayRecorder()
+    : fp(NULL), written(0), active(false)
+{
+    SetFilter(-1, 0, 1 << 30, 0, 360, 0, 180);
+}
+
+RayRecorder::~RayRecorder()
+{
+    Close();
+}
+
+void RayRecorder::SetFilter(int rx, int minDepth, int maxDepth,
+    double thetaMin, double thetaMax, double phiMin, double phiMax)
+{
+    this->rx = rx;
+    this->minDepth = minDepth;
+    this->maxDepth = maxDepth;
+    this->thetaMin = thetaMin;
+    this->thetaMax = thetaMax;
+    this->phiMin = phiMin;
+    this->phiMax = phiMax;
+}
+
+bool RayRecorder::Open(const char *filename)
+{
+    Close();
+
+    if (fopen_s(&fp, filename, "wb") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", filename);
+        fp = NULL;
+        return false;
+    }
+
+    int fileVersion = version;
+    fwrite("RTRD", 1, 4, fp);
+    fwrite(&fileVersion, sizeof(int), 1, fp);
+
+    this->filename = filename;
+    buffer.clear();
+    buffer.reserve(BufferSegments);
+    written = 0;
+    active = false;
+    return true;
+}
+
+void RayRecorder::Close()
+{
+    if (fp == NULL)
+        return;
+
+    flush();
+    if (writer.joinable())
+        writer.join();
+    fclose(fp);
+    fp = NULL;
+
+    fprintf(stderr, "    Ray recorder: %lld segments written to \"%s\"\n", written, filename.c_str());
+}
+
+void RayRecorder::write(FILE *fp, std::vector<Segment> *segments)
+{
+    if (!segments->empty() &&
+        fwrite(&(*segments)[0], sizeof(Segment), segments->size(), fp) != segments->size())
+    {
+        fprintf(stderr, "Error: Cannot write the ray recorder file\n");
+    }
+    delete segments;
+}
+
+void RayRecorder::flush()
+{
+    if (writer.joinable())
+        writer.join(); // the previous buffer is written
+
+    std::vector<Segment> *full = new std::vector<Segment>();
+    full->swap(buffer);
+    buffer.reserve(BufferSegments);
+
+    written += full->size();
+    writer = std::thread(write, fp, full);
+}
+
+void RayRecorder::add(const Point &start, const Point &end, int path, int depth, bool last, int rx)
+{
+    Segment s;
+    s.start[0] = (float)start.x;
+    s.start[1] = (float)start.y;
+    s.start[2] = (float)start.z;
+    s.end[0] = (float)end.x;
+    s.end[1] = (float)end.y;
+    s.end[2] = (float)end.z;
+    s.path = path;
+    s.depth = (short)depth;
+    s.last = last ? 1 : 0;
+    s.rx = rx;
+    buffer.push_back(s);
+
+    if ((int)buffer.size() >= BufferSegments)
+        flush();
+}
+
+void RayRecorder::BeginRay(const Point &origin, const Vector &direction)
+{
+    // Launch angles in degrees (see get_ray_direction() in Engine.cpp)
+    double theta = atan2(direction.y, direction.x) * 180.0 / PI;
+    if (theta < 0)
+        theta += 360.0;
+    double phi = acos(std::max(-1.0, std::min(1.0, direction.z / direction.length()))) * 180.0 / PI;
+
+    active = (theta >= thetaMin && theta <= thetaMax && phi >= phiMin && phi <= phiMax);
+    points.clear();
+    points.push_back(origin);
+}
+
+void RayRecorder::Push(const Point &point, int path)
+{
+    if (!active)
+        return;
+
+    // Without an rx filter every segment is written as soon as it is known
+    int depth = (int)points.size() - 1;
+    if (rx < 0 && depth >= minDepth && depth <= maxDepth)
+        add(points.back(), point, path, depth, false, -1);
+
+    points.push_back(point);
+}
+
+void RayRecorder::Pop()
+{
+    if (!active)
+        return;
+
+    points.pop_back();
+}
+
+void RayRecorder::Stop(const Point &point, int path)
+{
+    int depth = (int)points.size() - 1;
+    if (active && rx < 0 && depth >= minDepth && depth <= maxDepth)
+        add(points.back(), point, path, depth, false, -1);
+}
+
+void RayRecorder::Hit(int rxIndex, const Point &point, int path)
+{
+    if (!active)
+        return;
+
+    int depth = (int)points.size() - 1;
+    if (depth < minDepth || depth > maxDepth)
+        return;
+
+    if (rx < 0) // the earlier segments are written already
+    {
+        add(points.back(), point, path, depth, true, rxIndex);
+    }
+    else if (rx == rxIndex)
+    {
+        for (int i = 0; i < depth; i++)
+        {
+            add(points[i], points[i + 1], path, i, false, rxIndex);
+        }
+        add(points.back(), point, path, depth, true, rxIndex);
+    }
+}
+
+void RayRecorder::RecordPath(int rxIndex, const std::vector<Point> &pathPoints, int path)
+{
+    int depth = (int)pathPoints.size() - 2;
+    if (depth < minDepth || depth > maxDepth || (rx >= 0 && rx != rxIndex))
+        return;
+
+    BeginRay(pathPoints[0], Vector(pathPoints[0], pathPoints[1]));
+    if (!active)
+        return;
+    active = false; // not a ray in progress
+
+    for (int i = 0; i <= depth; i++)
+    {
+        add(pathPoints[i], pathPoints[i + 1], path, i, i == depth, rxIndex);
+    }
+}
+
+bool RayRecorder::Convert(const char *filename, const char *vtkFilename)
+{
+    // Read the segments
+    FILE *in = NULL;
+    if (fopen_s(&in, filename, "rb") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", filename);
+        return false;
+    }
+
+    char magic[4];
+    int fileVersion = 0;
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, "RTRD", 4) != 0 ||
+        fread(&fileVersion, sizeof(int), 1, in) != 1)
+    {
+        fprintf(stderr, "Error: \"%s\" is not a ray recorder file\n", filename);
+        fclose(in);
+        return false;
+    }
+    if (fileVersion != version)
+    {
+        fprintf(stderr, "Error: Unsupported ray recorder version %d\n", fileVersion);
+        fclose(in);
+        return false;
+    }
+
+    std::vector<Segment> segments;
+    Segment chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, sizeof(Segment), 4096, in)) > 0)
+    {
+        segments.insert(segments.end(), chunk, chunk + n);
+    }
+    fclose(in);
+
+    // Write a legacy VTK polydata file
+    FILE *out = NULL;
+    if (fopen_s(&out, vtkFilename, "w") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", vtkFilename);
+        return false;
+    }
+
+    int count = (int)segments.size();
+    fprintf(out, "# vtk DataFile Version 3.0\n");
+    fprintf(out, "Ray paths\n");
+    fprintf(out, "ASCII\n");
+    fprintf(out, "DATASET POLYDATA\n");
+
+    fprintf(out, "POINTS %d float\n", count * 2);
+    for (int i = 0; i < count; i++)
+    {
+        const Segment &s = segments[i];
+        fprintf(out, "%g %g %g\n%g %g %g\n", s.start[0], s.start[1], s.start[2], s.end[0], s.end[1], s.end[2]);
+    }
+
+    fprintf(out, "LINES %d %d\n", count, count * 3);
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "2 %d %d\n", i * 2, i * 2 + 1);
+    }
+
+    fprintf(out, "CELL_DATA %d\n", count);
+    fprintf(out, "SCALARS depth int 1\nLOOKUP_TABLE default\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%d\n", segments[i].depth);
+    }
+    fprintf(out, "SCALARS rx int 1\nLOOKUP_TABLE default\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%d\n", segments[i].rx);
+    }
+    fprintf(out, "SCALARS path int 1\nLOOKUP_TABLE default\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%d\n", segments[i].path);
+    }
+
+    bool ok = (ferror(out) == 0);
+    fclose(out);
+    if (!ok)
+    {
+        fprintf(stderr, "Error: Cannot write file \"%s\"\n", vtkFilename);
+        return false;
+    }
+
+    fprintf(stderr, "    %d segments converted to \"%s\"\n", count, vtkFilename);
+    return true;
+}
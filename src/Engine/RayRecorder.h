@@ -0,0 +1,94 @@
+#ifndef RAY_RECORDER_H
+#define RAY_RECORDER_H
+
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <string>
+#include "Vector.h"
+#include "Point.h"
+
+// Records the traced ray segments to a compact binary file, for visualization
+// and debugging.
+//
+// The segments are collected in a fixed-size buffer. A full buffer is handed to
+// a background thread for the disk write while tracing continues in the spare
+// one, so the tracing thread never formats or writes anything itself.
+//
+// Filters:
+//   rx:       only the paths that reach this rx point (-1 = all segments)
+//   depth:    only the paths with minDepth..maxDepth reflections (without an
+//             rx filter: the segments after minDepth..maxDepth reflections)
+//   window:   only the rays launched in [thetaMin, thetaMax] x [phiMin, phiMax]
+//             (degrees, theta: azimuth from +x, phi: from +z, as launched)
+//
+// File layout: char magic[4] ("RTRD"), int version, Segment * N
+class RayRecorder
+{
+public:
+    struct Segment
+    {
+        float start[3];
+        float end[3];
+        int path;  // RayPath::hash_code of the ray
+        short depth; // reflections before the segment
+        short last; // 1 for the last segment of a path to an rx point
+        int rx;    // rx point reached by the path (-1 = not known)
+    };
+
+    static const int BufferSegments = 65536;
+
+private:
+    static const int version = 1;
+
+    FILE *fp;
+    std::string filename;
+    std::vector<Segment> buffer;
+    std::thread writer; // writes the previous buffer
+    long long written;
+
+    // filters
+    int rx;
+    int minDepth;
+    int maxDepth;
+    double thetaMin, thetaMax;
+    double phiMin, phiMax;
+
+    // current ray
+    bool active;
+    std::vector<Point> points; // tx point and the reflection points so far
+
+private:
+    void add(const Point &start, const Point &end, int path, int depth, bool last, int rx);
+    void flush();
+    static void write(FILE *fp, std::vector<Segment> *segments);
+
+public:
+    RayRecorder();
+    ~RayRecorder();
+
+    void SetFilter(int rx, int minDepth, int maxDepth,
+        double thetaMin, double thetaMax, double phiMin, double phiMax);
+
+    bool Open(const char *filename);
+    void Close();
+    bool IsOpen() const { return fp != NULL; }
+
+    // Shooting and bouncing rays: BeginRay() at the tx point, Push() / Pop()
+    // around each reflection, Stop() at the last hit and Hit() for each rx
+    // sphere the ray passes
+    void BeginRay(const Point &origin, const Vector &direction);
+    void Push(const Point &point, int path);
+    void Pop();
+    void Stop(const Point &point, int path); // last hit, not traced further
+    void Hit(int rx, const Point &point, int path);
+
+    // A complete path tx -> reflections -> rx (ray tubes, tx sweep, direct fields)
+    void RecordPath(int rx, const std::vector<Point> &pathPoints, int path);
+
+    // Converts a recorded file to a legacy VTK polydata file (lines with the
+    // depth, rx and path as cell data), readable by ParaView and VisIt
+    static bool Convert(const char *filename, const char *vtkFilename);
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include "RayTube.h"
+#include <float.h>
+#include <algorithm>
+
+static double triple(const Vector &a, const Vector &b, const Vector &c)
+{
+    return a.cross(b).dot(c);
+}
+
+Vector RayTube::center() const
+{
+    return (edges[0] + edges[1] + edges[2]).norm();
+}
+
+Point RayTube::origin(const Vector &dir) const
+{
+    if (!hasEntry)
+        return source;
+
+    // source + t * dir on the entry plane
+    double t = Vector(source, entryPoint).dot(entryNormal) / dir.dot(entryNormal);
+    return source + dir * t;
+}
+
+bool RayTube::contains(const Point &p) const
+{
+    Vector v(source, p);
+
+    // The edges may be clockwise or counterclockwise (mirrored by reflections)
+    double orientation = triple(edges[0], edges[1], edges[2]);
+    double s0 = triple(edges[0], edges[1], v);
+    double s1 = triple(edges[1], edges[2], v);
+    double s2 = triple(edges[2], edges[0], v);
+
+    if (orientation > 0)
+    {
+        if (s0 < 0 || s1 < 0 || s2 < 0)
+            return false;
+    }
+    else
+    {
+        if (s0 > 0 || s1 > 0 || s2 > 0)
+            return false;
+    }
+
+    if (hasEntry && Vector(entryPoint, p).dot(entryNormal) < 0)
+        return false;
+
+    return true;
+}
+
+void RayTube::split(RayTube sub[4]) const
+{
+    // edges[0] -- m0 -- edges[1]
+    //        \   /  \   /
+    //         m2 --- m1
+    //           \   /
+    //          edges[2]
+    Vector m0 = (edges[0] + edges[1]).norm();
+    Vector m1 = (edges[1] + edges[2]).norm();
+    Vector m2 = (edges[2] + edges[0]).norm();
+
+    for (int i = 0; i < 4; i++)
+    {
+        sub[i] = *this;
+        sub[i].level = level + 1;
+    }
+
+    sub[0].edges[0] = edges[0]; sub[0].edges[1] = m0; sub[0].edges[2] = m2;
+    sub[1].edges[0] = m0; sub[1].edges[1] = edges[1]; sub[1].edges[2] = m1;
+    sub[2].edges[0] = m2; sub[2].edges[1] = m1; sub[2].edges[2] = edges[2];
+    sub[3].edges[0] = m0; sub[3].edges[1] = m1; sub[3].edges[2] = m2;
+}
+
+void RayTube::reflect(const Point &p, const Vector &nl)
+{
+    // image of the source
+    double d = Vector(p, source).dot(nl);
+    source = source + nl * (-2 * d);
+
+    for (int i = 0; i < 3; i++)
+    {
+        edges[i] = edges[i] - nl * 2 * nl.dot(edges[i]);
+    }
+
+    // the reflected rays leave the plane on the side of the incoming ray
+    hasEntry = true;
+    entryPoint = p;
+    entryNormal = nl;
+}
+
+int RayTube::FaceCount(int level)
+{
+    int count = 20;
+    for (int i = 0; i < level; i++)
+    {
+        count *= 4;
+    }
+    return count;
+}
+
+static void subdivide(const RayTube &tube, int level, std::vector<RayTube> &tubes)
+{
+    if (tube.level >= level)
+    {
+        tubes.push_back(tube);
+        return;
+    }
+
+    RayTube sub[4];
+    tube.split(sub);
+    for (int i = 0; i < 4; i++)
+    {
+        subdivide(sub[i], level, tubes);
+    }
+}
+
+// Tubes of the "face"-th face of the icosahedron subdivided "faceLevel" times,
+// each of which is further subdivided to "level"
+void RayTube::Launch(const Point &source, int face, int faceLevel, int level, std::vector<RayTube> &tubes)
+{
+    // http://en.wikipedia.org/wiki/Regular_icosahedron
+    const double t = (1.0 + sqrt(5.0)) / 2.0;
+    const double vertices[12][3] = {
+        { -1,  t,  0 }, {  1,  t,  0 }, { -1, -t,  0 }, {  1, -t,  0 },
+        {  0, -1,  t }, {  0,  1,  t }, {  0, -1, -t }, {  0,  1, -t },
+        {  t,  0, -1 }, {  t,  0,  1 }, { -t,  0, -1 }, { -t,  0,  1 } };
+    const int faces[20][3] = {
+        { 0, 11,  5 }, { 0,  5,  1 }, { 0,  1,  7 }, { 0,  7, 10 }, { 0, 10, 11 },
+        { 1,  5,  9 }, { 5, 11,  4 }, { 11, 10, 2 }, { 10, 7,  6 }, { 7,  1,  8 },
+        { 3,  9,  4 }, { 3,  4,  2 }, { 3,  2,  6 }, { 3,  6,  8 }, { 3,  8,  9 },
+        { 4,  9,  5 }, { 2,  4, 11 }, { 6,  2, 10 }, { 8,  6,  7 }, { 9,  8,  1 } };
+
+    // Find the face: faceLevel subdivisions of face / 4^faceLevel
+    int subFaces = FaceCount(faceLevel) / 20;
+    int base = face / subFaces;
+    int index = face % subFaces;
+
+    // The icosahedron is rotated by a fixed angle, so that the edges of the tubes
+    // do not lie on the axes, where rx points are often placed
+    const double a = 0.1234; // around z (radians)
+    const double b = 0.2345; // around x (radians)
+
+    RayTube tube;
+    tube.source = source;
+    for (int i = 0; i < 3; i++)
+    {
+        const double *v = vertices[faces[base][i]];
+        double x = v[0] * cos(a) - v[1] * sin(a);
+        double y = v[0] * sin(a) + v[1] * cos(a);
+        double z = v[2];
+        tube.edges[i] = Vector(x, y * cos(b) - z * sin(b), y * sin(b) + z * cos(b)).norm();
+    }
+
+    for (int l = 0; l < faceLevel; l++)
+    {
+        subFaces /= 4;
+        RayTube sub[4];
+        tube.split(sub);
+        tube = sub[index / subFaces];
+        index %= subFaces;
+    }
+
+    subdivide(tube, level, tubes);
+}
+
+void RxGrid::init(const std::vector<Point> &points)
+{
+    double min_x = DBL_MAX, min_y = DBL_MAX, min_z = DBL_MAX;
+    double max_x = -DBL_MAX, max_y = -DBL_MAX, max_z = -DBL_MAX;
+
+    for (unsigned int i = 0; i < points.size(); i++)
+    {
+        min_x = std::min(min_x, points[i].x);
+        min_y = std::min(min_y, points[i].y);
+        min_z = std::min(min_z, points[i].z);
+
+        max_x = std::max(max_x, points[i].x);
+        max_y = std::max(max_y, points[i].y);
+        max_z = std::max(max_z, points[i].z);
+    }
+
+    if (points.empty())
+    {
+        min_x = min_y = min_z = max_x = max_y = max_z = 0;
+    }
+
+    // About one rx point per cell
+    double width = max_x - min_x;
+    double height = max_y - min_y;
+    double depth = max_z - min_z;
+    double maxLength = std::max(std::max(width, height), depth);
+    int nonFlat = (width > maxLength * 0.01) + (height > maxLength * 0.01) + (depth > maxLength * 0.01);
+
+    cellSize = (maxLength > 0 && nonFlat > 0) ? 
+        maxLength / pow((double)points.size(), 1.0 / nonFlat) : 1.0;
+    cellSize = std::max(cellSize, maxLength / 1000.0);
+
+    min = Point(min_x, min_y, min_z);
+    max = Point(max_x, max_y, max_z);
+    xLength = (int)(width / cellSize) + 1;
+    yLength = (int)(height / cellSize) + 1;
+    zLength = (int)(depth / cellSize) + 1;
+
+    cells.clear();
+    cells.resize(xLength * yLength * zLength);
+
+    for (unsigned int m = 0; m < points.size(); m++)
+    {
+        int i = std::min((int)((points[m].x - min.x) / cellSize), xLength - 1);
+        int j = std::min((int)((points[m].y - min.y) / cellSize), yLength - 1);
+        int k = std::min((int)((points[m].z - min.z) / cellSize), zLength - 1);
+        cells[(i * yLength + j) * zLength + k].push_back(m);
+    }
+}
+
+void RxGrid::getBounds(Point &min, Point &max) const
+{
+    min = this->min;
+    max = this->max;
+}
+
+void RxGrid::query(const Point &qmin, const Point &qmax, std::vector<int> &indexes) const
+{
+    indexes.clear();
+
+    if (qmax.x < min.x || qmin.x > max.x ||
+        qmax.y < min.y || qmin.y > max.y ||
+        qmax.z < min.z || qmin.z > max.z)
+    {
+        return;
+    }
+
+    // clamp before converting to int (the box of an escaping tube can be huge)
+    int i_begin = (int)std::max((qmin.x - min.x) / cellSize, 0.0);
+    int j_begin = (int)std::max((qmin.y - min.y) / cellSize, 0.0);
+    int k_begin = (int)std::max((qmin.z - min.z) / cellSize, 0.0);
+
+    int i_end = (int)std::min((qmax.x - min.x) / cellSize, xLength - 1.0);
+    int j_end = (int)std::min((qmax.y - min.y) / cellSize, yLength - 1.0);
+    int k_end = (int)std::min((qmax.z - min.z) / cellSize, zLength - 1.0);
+
+    for (int i = i_begin; i <= i_end; i++)
+    {
+        for (int j = j_begin; j <= j_end; j++)
+        {
+            for (int k = k_begin; k <= k_end; k++)
+            {
+                const std::vector<int> &cell = cells[(i * yLength + j) * zLength + k];
+                indexes.insert(indexes.end(), cell.begin(), cell.end());
+            }
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef RAY_TUBE_H
+#define RAY_TUBE_H
+
+#include <vector>
+#include "Point.h"
+#include "Vector.h"
+
+// A triangular ray tube
+//
+// The three edge rays start from the (image) source and pass the entry plane.
+// After a reflection on a plane, the tube is mirrored: the source becomes its
+// image and the edge directions are reflected, so every point of the tube
+// still lies on a straight line from the (image) source.
+//
+//            entry plane   exit plane
+//                 |            |
+//   source  ------+------------+   edge ray 0
+//     *   ------- | receiver   | 
+//         ------- |    x       |
+//           ------+------------+   edge ray 1
+//
+struct RayTube
+{
+    Point source;
+    Vector edges[3];  // unit directions of the edge rays
+
+    bool hasEntry;    // false for tubes from the tx point
+    Point entryPoint;
+    Vector entryNormal; // points into the tube
+
+    int level;        // subdivision level of the tube
+
+    RayTube() : hasEntry(false), level(0) {}
+
+    Vector center() const; // unit direction of the central ray
+    Point origin(const Vector &dir) const; // where the ray (from source) enters the tube
+    bool contains(const Point &p) const; // inside the cone and after the entry plane
+
+    void split(RayTube sub[4]) const;
+    void reflect(const Point &p, const Vector &nl); // nl: normal of the plane (points to the incoming ray)
+
+    // Tubes by subdividing a face of an icosahedron
+    static int FaceCount(int level);
+    static void Launch(const Point &source, int face, int faceLevel, int level, std::vector<RayTube> &tubes);
+};
+
+// Uniform grid of rx points, used to find the candidate rx points of a tube
+class RxGrid
+{
+private:
+    Point min;
+    Point max;
+    double cellSize;
+    int xLength;
+    int yLength;
+    int zLength;
+    std::vector<std::vector<int> > cells;
+
+public:
+    void init(const std::vector<Point> &points);
+    void getBounds(Point &min, Point &max) const;
+    void query(const Point &min, const Point &max, std::vector<int> &indexes) const; // rx points in the box
+};
+
+#endif
@@ -1,47 +1,133 @@
 #include "RxFields.h"
+#include <string.h>
+#include <algorithm>
 
-void RxFields::AddField(const ComplexVector &field, const RayPath &path, double offset)
+bool RxFields::AddField(const PolarField &field, const RayPath &path, double offset,
+    const Vector &departure, const Vector &arrival)
 {
-    if (mapping.count(path) == 0)
+    std::unordered_map<RayPath, RxField>::iterator it = mapping.find(path);
+    if (it == mapping.end())
     {
-        mapping[path] = std::vector<RxField>();
+        mapping.insert(std::make_pair(path, RxField(field, offset, departure, arrival)));
+        return true;
     }
-    mapping[path].push_back(RxField(field, offset));
+
+    // use the field with the min distance (the earliest one wins a tie)
+    if (offset < it->second.offset)
+    {
+        it->second = RxField(field, offset, departure, arrival);
+    }
+    return false;
+}
+
+static bool cmpPathField(const RxPathField &a, const RxPathField &b)
+{
+    return a.hash_code < b.hash_code;
+}
+
+void RxFields::Collect(std::vector<RxPathField> &fields)
+{
+    fields.clear();
+    fields.reserve(mapping.size());
+
+    std::unordered_map<RayPath, RxField>::iterator it;
+    for (it = mapping.begin(); it != mapping.end(); ++it) // for each path
+    {
+        fields.push_back(RxPathField(it->first.hash_code, it->second));
+    }
+    std::sort(fields.begin(), fields.end(), cmpPathField);
+}
+
+int RxFields::Count() const
+{
+    return (int)mapping.size();
+}
+
+void RxFields::Clear()
+{
+    std::unordered_map<RayPath, RxField>().swap(mapping); // release the buckets as well
 }
 
-ComplexVector RxFields::Sum()
+PolarField RxFields::Sum()
 {
-    ComplexVector sum(
-        ComplexNumber(0, 0),
-        ComplexNumber(0, 0),
-        ComplexNumber(0, 0));
+    PolarField sum;
+
+    // The fields are added in the order of path hash codes rather than the
+    // iteration order of the hash map, so that the sum does not depend on
+    // the insertion history (e.g. a run resumed from a checkpoint)
+    std::vector<RxPathField> fields;
+    Collect(fields);
 
-    if (mapping.size() == 0)
+    for (unsigned int i = 0; i < fields.size(); i++)
     {
-        return sum;
+        sum = sum + fields[i].field.field;
     }
-    else
+    return sum;
+}
+
+// Record layout (per rx point):
+//   int count
+//   count * { int hash_code, double offset, double field[12], double departure[3], double arrival[3] }
+void RxFields::Dump(std::vector<char> &buffer)
+{
+    int count = (int)mapping.size();
+    buffer.insert(buffer.end(), (char *)&count, (char *)&count + sizeof(int));
+
+    std::unordered_map<RayPath, RxField>::iterator it;
+    for (it = mapping.begin(); it != mapping.end(); ++it) // for each path
     {
-        std::unordered_map<RayPath, std::vector<RxField> >::iterator it;
-        for (it = mapping.begin(); it != mapping.end(); ++it) // for each path
-        {
-            // use the field with the min distance
-            double minOffset = DBL_MAX;
-            ComplexVector minField(
-                ComplexNumber(0, 0),
-                ComplexNumber(0, 0),
-                ComplexNumber(0, 0));
-
-            for (unsigned int i = 0; i < it->second.size(); i++)
-            {
-                if (it->second[i].offset < minOffset)
-                {
-                    minOffset = it->second[i].offset;
-                    minField = it->second[i].field;
-                }
-            }
-            sum = sum + minField;
-        }
-        return sum;
+        const RxField &f = it->second;
+
+        double values[19] = {
+            f.offset,
+            f.field.theta.x.a, f.field.theta.x.b,
+            f.field.theta.y.a, f.field.theta.y.b,
+            f.field.theta.z.a, f.field.theta.z.b,
+            f.field.phi.x.a, f.field.phi.x.b,
+            f.field.phi.y.a, f.field.phi.y.b,
+            f.field.phi.z.a, f.field.phi.z.b,
+            f.departure.x, f.departure.y, f.departure.z,
+            f.arrival.x, f.arrival.y, f.arrival.z };
+
+        buffer.insert(buffer.end(), (char *)&it->first.hash_code, (char *)&it->first.hash_code + sizeof(int));
+        buffer.insert(buffer.end(), (char *)values, (char *)values + sizeof(values));
+    }
+}
+
+const char *RxFields::Load(const char *data, const char *end)
+{
+    const int recordSize = sizeof(int) + 19 * sizeof(double);
+
+    int count = 0;
+    if (end - data < (int)sizeof(int))
+        return NULL;
+    memcpy(&count, data, sizeof(int));
+    data += sizeof(int);
+
+    if (count < 0 || end - data < (long long)count * recordSize)
+        return NULL;
+
+    Clear();
+    for (int i = 0; i < count; i++)
+    {
+        RayPath path;
+        double values[19];
+        memcpy(&path.hash_code, data, sizeof(int));
+        memcpy(values, data + sizeof(int), sizeof(values));
+        data += recordSize;
+
+        PolarField field(
+            ComplexVector(
+                ComplexNumber(values[1], values[2]),
+                ComplexNumber(values[3], values[4]),
+                ComplexNumber(values[5], values[6])),
+            ComplexVector(
+                ComplexNumber(values[7], values[8]),
+                ComplexNumber(values[9], values[10]),
+                ComplexNumber(values[11], values[12])));
+        Vector departure(values[13], values[14], values[15]);
+        Vector arrival(values[16], values[17], values[18]);
+        mapping.insert(std::make_pair(path, RxField(field, values[0], departure, arrival)));
     }
+    return data;
 }
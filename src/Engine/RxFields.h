@@ -9,20 +9,47 @@
 // Rx field
 struct RxField
 {
-    ComplexVector field;
+    PolarField field; // fields of both tx polarizations
     double offset; // offset from the ray to the center of the rx sphere
+    Vector departure; // unit direction of the path leaving the tx
+    Vector arrival; // unit direction of the path arriving at the rx
 
-    RxField(const ComplexVector &field, double offset) : field(field), offset(offset) {}
+    RxField(const PolarField &field, double offset, const Vector &departure, const Vector &arrival)
+        : field(field), offset(offset), departure(departure), arrival(arrival) {}
+};
+
+// The field of one path, used to move fields out of the hash map
+struct RxPathField
+{
+    int hash_code; // RayPath::hash_code
+    RxField field;
+
+    RxPathField(int hash_code, const RxField &field) : hash_code(hash_code), field(field) {}
 };
 
 class RxFields
 {
 private:
-    std::unordered_map<RayPath, std::vector<RxField> > mapping;
+    // Only the field with the min offset of each path is used by Sum(),
+    // so the others are dropped as soon as they arrive
+    std::unordered_map<RayPath, RxField> mapping;
 
 public:
-    void AddField(const ComplexVector &field, const RayPath &path, double offset);
-    ComplexVector Sum();
+    bool AddField(const PolarField &field, const RayPath &path, double offset,
+        const Vector &departure, const Vector &arrival); // returns true for a new path
+    PolarField Sum();
+
+    // Fields of all paths, sorted by hash code
+    void Collect(std::vector<RxPathField> &fields);
+    int Count() const;
+    void Clear();
+
+    // Binary (de)serialization used by checkpoints
+    void Dump(std::vector<char> &buffer);
+    const char *Load(const char *data, const char *end); // returns NULL on error
+
+    // Approximate memory used by one path in the hash map
+    static const int BytesPerPath = sizeof(RayPath) + sizeof(RxField) + 4 * sizeof(void *);
 };
 
 #endif
@@ -0,0 +1,69 @@
+#include "RxSampling.h"
+#include <float.h>
+#include <math.h>
+
+void RxSampling::Reset(int nRx)
+{
+    rxPaths.clear();
+    rxPaths.resize(nRx);
+}
+
+void RxSampling::Get(int rx, int &paths, int &minHits, double &minExpectedHits) const
+{
+    paths = (int)rxPaths[rx].size();
+    minHits = 0;
+    minExpectedHits = 0;
+
+    std::unordered_map<int, PathStats>::const_iterator it;
+    for (it = rxPaths[rx].begin(); it != rxPaths[rx].end(); ++it)
+    {
+        if (it == rxPaths[rx].begin() || it->second.hits < minHits)
+            minHits = it->second.hits;
+        if (it == rxPaths[rx].begin() || it->second.expectedHits < minExpectedHits)
+            minExpectedHits = it->second.expectedHits;
+    }
+}
+
+double RxSampling::RecommendSpacing(double spacing, int minHits) const
+{
+    double minExpectedHits = DBL_MAX;
+    for (unsigned int i = 0; i < rxPaths.size(); i++)
+    {
+        std::unordered_map<int, PathStats>::const_iterator it;
+        for (it = rxPaths[i].begin(); it != rxPaths[i].end(); ++it)
+        {
+            if (it->second.expectedHits < minExpectedHits)
+                minExpectedHits = it->second.expectedHits;
+        }
+    }
+    if (minExpectedHits == DBL_MAX)
+        return 0;
+
+    // expected hits ~ 1 / spacing^2
+    return spacing * sqrt(minExpectedHits / minHits);
+}
+
+int RxSampling::CountUndersampled(int minHits) const
+{
+    int n = 0;
+    for (unsigned int i = 0; i < rxPaths.size(); i++)
+    {
+        std::unordered_map<int, PathStats>::const_iterator it;
+        for (it = rxPaths[i].begin(); it != rxPaths[i].end(); ++it)
+        {
+            if (it->second.hits < minHits)
+                n += 1;
+        }
+    }
+    return n;
+}
+
+int RxSampling::CountPaths() const
+{
+    int n = 0;
+    for (unsigned int i = 0; i < rxPaths.size(); i++)
+    {
+        n += (int)rxPaths[i].size();
+    }
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef RX_SAMPLING_H
+#define RX_SAMPLING_H
+
+#include <vector>
+#include <unordered_map>
+
+// Sampling diagnostics of the rx spheres (shooting and bouncing rays).
+//
+// For every (rx, path) pair found by a simulation it counts the rays that hit
+// the sphere, and keeps the expected number of hits: the sphere cross section
+// over the cross section of one ray tube at the rx point
+// (unit_surface_area * mileage^2). The expected hits scale with the inverse
+// square of the ray spacing, which gives the coarsest spacing that still
+// expects minHits rays on every path found.
+class RxSampling
+{
+public:
+    struct PathStats
+    {
+        int hits;
+        double expectedHits; // min over the hits
+    };
+
+private:
+    std::vector<std::unordered_map<int, PathStats> > rxPaths; // per rx, by RayPath::hash_code
+
+public:
+    void Reset(int nRx);
+    bool Empty() const { return rxPaths.empty(); }
+
+    void Hit(int rx, int path, double expectedHits)
+    {
+        std::unordered_map<int, PathStats>::iterator it = rxPaths[rx].find(path);
+        if (it == rxPaths[rx].end())
+        {
+            PathStats stats = { 1, expectedHits };
+            rxPaths[rx].insert(std::make_pair(path, stats));
+        }
+        else
+        {
+            it->second.hits += 1;
+            if (expectedHits < it->second.expectedHits)
+                it->second.expectedHits = expectedHits;
+        }
+    }
+
+    // Per rx: distinct paths, the fewest hits of a path and the fewest
+    // expected hits of a path (0 when no path reached the rx)
+    void Get(int rx, int &paths, int &minHits, double &minExpectedHits) const;
+
+    // Coarsest spacing (same unit as "spacing") expecting minHits hits on
+    // every path found, 0 when no path was found
+    double RecommendSpacing(double spacing, int minHits) const;
+
+    // Paths with fewer than minHits hits
+    int CountUndersampled(int minHits) const;
+    int CountPaths() const;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#include "RxSpill.h"
+#include <stdio.h>
+#include <string.h>
+
+// Buffered sequential reader of a run file
+class RxSpill::Reader
+{
+private:
+    FILE *fp;
+    std::vector<Record> buffer;
+    unsigned int pos;
+    unsigned int count;
+
+public:
+    Record current;
+    bool valid;
+    bool failed; // read error
+
+public:
+    Reader() : fp(NULL), buffer(4096), pos(0), count(0), valid(false), failed(false) {}
+    ~Reader() { if (fp != NULL) fclose(fp); }
+
+    bool open(const char *filename)
+    {
+        if (fopen_s(&fp, filename, "rb") != 0)
+        {
+            fprintf(stderr, "Error: Cannot open file \"%s\"\n", filename);
+            return false;
+        }
+
+        // A truncated run would silently lose paths
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if (size < 0 || size % sizeof(Record) != 0)
+        {
+            fprintf(stderr, "Error: Invalid run file \"%s\"\n", filename);
+            return false;
+        }
+
+        next();
+        return !failed;
+    }
+
+    void next()
+    {
+        if (pos == count)
+        {
+            count = (unsigned int)fread(&buffer[0], sizeof(Record), buffer.size(), fp);
+            pos = 0;
+            failed = failed || ferror(fp) != 0;
+        }
+        valid = (pos < count);
+        if (valid)
+        {
+            current = buffer[pos++];
+        }
+    }
+};
+
+RxSpill::RxSpill() : directory("."), runs(0)
+{
+}
+
+RxSpill::~RxSpill()
+{
+}
+
+std::string RxSpill::runFilename(int run) const
+{
+    char name[32];
+    sprintf_s(name, sizeof(name), "rxspill-%04d.bin", run);
+    return directory + "/" + name;
+}
+
+void RxSpill::SetDirectory(const char *directory)
+{
+    this->directory = (directory != NULL && directory[0] != '\0') ? directory : ".";
+}
+
+void RxSpill::Reset()
+{
+    for (int i = 0; i < runs; i++)
+    {
+        remove(runFilename(i).c_str());
+    }
+    runs = 0;
+}
+
+void RxSpill::Restore(int runs)
+{
+    this->runs = runs;
+}
+
+int RxSpill::RunCount() const
+{
+    return runs;
+}
+
+bool RxSpill::Spill(std::vector<RxFields> &fields)
+{
+    std::string filename = runFilename(runs);
+
+    FILE *fp = NULL;
+    if (fopen_s(&fp, filename.c_str(), "wb") != 0)
+    {
+        fprintf(stderr, "Error: Cannot open file \"%s\"\n", filename.c_str());
+        return false;
+    }
+
+    // rx points are visited in order and their paths are sorted by RxFields,
+    // so the run is sorted without a global sort
+    std::vector<RxPathField> paths;
+    std::vector<Record> records;
+    bool ok = true;
+
+    for (unsigned int i = 0; i < fields.size() && ok; i++)
+    {
+        fields[i].Collect(paths);
+
+        records.resize(paths.size());
+        for (unsigned int j = 0; j < paths.size(); j++)
+        {
+            const RxField &f = paths[j].field;
+            records[j].rx = i;
+            records[j].hash_code = paths[j].hash_code;
+            records[j].offset = f.offset;
+            records[j].field[0] = f.field.theta.x.a;
+            records[j].field[1] = f.field.theta.x.b;
+            records[j].field[2] = f.field.theta.y.a;
+            records[j].field[3] = f.field.theta.y.b;
+            records[j].field[4] = f.field.theta.z.a;
+            records[j].field[5] = f.field.theta.z.b;
+            records[j].field[6] = f.field.phi.x.a;
+            records[j].field[7] = f.field.phi.x.b;
+            records[j].field[8] = f.field.phi.y.a;
+            records[j].field[9] = f.field.phi.y.b;
+            records[j].field[10] = f.field.phi.z.a;
+            records[j].field[11] = f.field.phi.z.b;
+        }
+
+        if (!records.empty() &&
+            fwrite(&records[0], sizeof(Record), records.size(), fp) != records.size())
+        {
+            fprintf(stderr, "Error: Cannot write file \"%s\"\n", filename.c_str());
+            ok = false;
+        }
+    }
+
+    if (fclose(fp) != 0 && ok)
+    {
+        fprintf(stderr, "Error: Cannot write file \"%s\"\n", filename.c_str());
+        ok = false;
+    }
+
+    // The fields are only dropped from memory once the whole run is on disk,
+    // a partial run is removed so that Merge() never sees it
+    if (!ok)
+    {
+        remove(filename.c_str());
+        return false;
+    }
+
+    for (unsigned int i = 0; i < fields.size(); i++)
+    {
+        fields[i].Clear();
+    }
+    runs += 1;
+    return true;
+}
+
+bool RxSpill::Merge(int nRx, void (*callback)(int rx, PolarField &sum))
+{
+    std::vector<Reader *> readers;
+    for (int i = 0; i < runs; i++)
+    {
+        readers.push_back(new Reader());
+        if (!readers[i]->open(runFilename(i).c_str()))
+        {
+            for (unsigned int j = 0; j < readers.size(); j++)
+                delete readers[j];
+            return false;
+        }
+    }
+
+    for (int rx = 0; rx < nRx; rx++)
+    {
+        PolarField sum;
+
+        while (true)
+        {
+            // Next path of this rx point: the smallest hash code among the readers
+            int hash = 0;
+            bool found = false;
+            for (int i = 0; i < runs; i++)
+            {
+                if (readers[i]->valid && readers[i]->current.rx == rx &&
+                    (!found || readers[i]->current.hash_code < hash))
+                {
+                    hash = readers[i]->current.hash_code;
+                    found = true;
+                }
+            }
+            if (!found)
+                break;
+
+            // Pick the min offset, runs are visited in the order they were written
+            const Record *min = NULL;
+            Record minRecord;
+            for (int i = 0; i < runs; i++)
+            {
+                if (readers[i]->valid && readers[i]->current.rx == rx &&
+                    readers[i]->current.hash_code == hash)
+                {
+                    if (min == NULL || readers[i]->current.offset < min->offset)
+                    {
+                        minRecord = readers[i]->current;
+                        min = &minRecord;
+                    }
+                    readers[i]->next();
+                }
+            }
+
+            sum = sum + PolarField(
+                ComplexVector(
+                    ComplexNumber(min->field[0], min->field[1]),
+                    ComplexNumber(min->field[2], min->field[3]),
+                    ComplexNumber(min->field[4], min->field[5])),
+                ComplexVector(
+                    ComplexNumber(min->field[6], min->field[7]),
+                    ComplexNumber(min->field[8], min->field[9]),
+                    ComplexNumber(min->field[10], min->field[11])));
+        }
+
+        callback(rx, sum);
+    }
+
+    // Every record must have been consumed without a read error
+    bool ok = true;
+    for (int i = 0; i < runs; i++)
+    {
+        if (readers[i]->failed || readers[i]->valid)
+        {
+            fprintf(stderr, "Error: Cannot read file \"%s\"\n", runFilename(i).c_str());
+            ok = false;
+        }
+        delete readers[i];
+    }
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef RX_SPILL_H
+#define RX_SPILL_H
+
+#include <vector>
+#include <string>
+#include "RxFields.h"
+
+// Spills the accumulated rx fields to disk when they exceed the memory limit.
+//
+// Each spill writes one "run": the min-offset field of every (rx, path) pair,
+// sorted by rx index and path hash code. At the end, all runs are merged in a
+// single streaming pass, which picks the same field per path as RxFields does
+// in memory (min offset, the earliest one wins a tie) and adds the paths in
+// the same order as RxFields::Sum(), so the result equals an in-memory run.
+//
+// Run file layout: { int rx, int hash_code, double offset, double field[12] } * N
+class RxSpill
+{
+private:
+    struct Record
+    {
+        int rx;
+        int hash_code;
+        double offset;
+        double field[12]; // theta and phi fields (see PolarField)
+    };
+
+    class Reader;
+
+    std::string directory;
+    int runs;
+
+private:
+    std::string runFilename(int run) const;
+
+public:
+    RxSpill();
+    ~RxSpill();
+
+    void SetDirectory(const char *directory);
+    void Reset();             // remove all runs
+    void Restore(int runs);   // reuse runs [0, runs) written before a checkpoint
+    int RunCount() const;
+
+    bool Spill(std::vector<RxFields> &fields); // write a run and clear the fields, kept if the write fails
+
+    // Merge the runs, the sum of each rx point is passed to the callback in the order of rx index
+    // (false when a run cannot be read, the callback may have been called for some rx points)
+    bool Merge(int nRx, void (*callback)(int rx, PolarField &sum));
+};
+
+#endif
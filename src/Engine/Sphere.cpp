@@ -13,7 +13,7 @@ Point Sphere::getCenter() const
     return center;
 }
 
-void Sphere::getBoundingBox(Point &min, Point &max)
+void Sphere::getBoundingBox(Point &min, Point &max) const
 {
     min.x = center.x - radius;
     min.y = center.y - radius;
@@ -24,6 +24,13 @@ void Sphere::getBoundingBox(Point &min, Point &max)
     max.z = center.z + radius;
 }
 
+unsigned int Sphere::hash(unsigned int seed) const
+{
+    double values[4] = { center.x, center.y, center.z, radius };
+    seed = hashBytes(seed, values, sizeof(values));
+    return hashBytes(seed, &material, sizeof(material));
+}
+
 IntersectResult Sphere::intersect(Ray &ray)
 { 
     IntersectResult result(false);
@@ -45,6 +52,8 @@ IntersectResult Sphere::intersect(Ray &ray)
         {
             result.hit = true;
             result.geometry = this;
+            result.facet = index;
+            result.material = material;
             //result.distance = (-b - delta >= 0.0005f) ? -b - delta : -b + delta;
             result.distance = -b; // in the SBR algorithm, there should be only one intersection
             result.position = ray.getPoint(result.distance);
@@ -12,8 +12,9 @@ public:
 public:
     Sphere(const Point &center, double radius);
     virtual Point getCenter() const;
-    virtual void getBoundingBox(Point &min, Point &max);
+    virtual void getBoundingBox(Point &min, Point &max) const;
     virtual IntersectResult intersect(Ray &ray);
+    virtual unsigned int hash(unsigned int seed) const;
 };
 
 class RxSphere : public Sphere
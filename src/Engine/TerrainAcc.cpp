@@ -0,0 +1,51 @@
+#include "TerrainAcc.h"
+
+void TerrainAcc::init()
+{
+    triangles->init();
+    initPrimitives();
+}
+
+void TerrainAcc::initPrimitives()
+{
+    for (unsigned int i = 0; i < primitives->size(); i++)
+    {
+        if ((*primitives)[i]->type == BUILDINGS)
+            ((Buildings *)(*primitives)[i])->build();
+    }
+}
+
+bool TerrainAcc::update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed)
+{
+    return triangles->update(added, removed);
+}
+
+IntersectResult TerrainAcc::intersect(Ray &ray, std::vector<RxIntersection> &rxPoints)
+{
+    IntersectResult result = triangles->intersect(ray, rxPoints);
+
+    bool primitive = false;
+    for (unsigned int i = 0; i < primitives->size(); i++)
+    {
+        IntersectResult other = (*primitives)[i]->intersect(ray);
+        if (other.hit && (!result.hit || other.distance < result.distance))
+        {
+            result = other;
+            primitive = true;
+        }
+    }
+
+    // Drop the rx spheres behind the primitive
+    if (primitive)
+    {
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < rxPoints.size(); i++)
+        {
+            if (rxPoints[i].distance < result.distance)
+                rxPoints[n++] = rxPoints[i];
+        }
+        rxPoints.erase(rxPoints.begin() + n, rxPoints.end());
+    }
+
+    return result;
+}
@@ -0,0 +1,29 @@
+#ifndef TERRAIN_ACC_H
+#define TERRAIN_ACC_H
+
+#include "Accelerator.h"
+#include "Heightfield.h"
+#include "Buildings.h"
+
+// Heightfield terrain and building sets next to a triangle accelerator
+//
+// These primitives are not put into the scene (one huge bounding box would
+// end up in every node of the triangle accelerator), a ray is tested against
+// the triangle accelerator and every primitive, and the nearest hit wins.
+class TerrainAcc : public Accelerator
+{
+private:
+    Accelerator *triangles;
+    std::vector<Geometry *> *primitives; // heightfields and building sets
+
+public:
+    TerrainAcc(Accelerator *triangles, std::vector<Geometry *> *primitives)
+        : Accelerator(NULL), triangles(triangles), primitives(primitives) {}
+    Accelerator *getTriangles() const { return triangles; }
+    virtual void init();
+    void initPrimitives(); // init() for a triangle accelerator that is already built
+    virtual bool update(const std::vector<Geometry *> &added, const std::vector<Geometry *> &removed);
+    virtual IntersectResult intersect(Ray &ray, std::vector<RxIntersection> &rxPoints);
+};
+
+#endif
@@ -16,6 +16,16 @@ Triangle::Triangle(const Point &a, const Point &b, const Point &c, const Vector
     type = GeometryType::TRIANGLE;
 }
 
+Triangle::Triangle(const Point &a, const Point &b, const Point &c, const Vector &normal, int index)
+    : Geometry(index)
+{
+    this->a = a;
+    this->b = b;
+    this->c = c;
+    this->normal = normal;
+    type = GeometryType::TRIANGLE;
+}
+
 Triangle::Triangle(const Point &a, const Point &b, const Point &c)
 {
     this->a = a;
@@ -46,7 +56,7 @@ Point Triangle::getCenter() const
         (a.z + b.z + c.z) / 3);
 }
 
-void Triangle::getBoundingBox(Point &min, Point &max)
+void Triangle::getBoundingBox(Point &min, Point &max) const
 {
     double min_x = DBL_MAX, min_y = DBL_MAX, min_z = DBL_MAX;
     double max_x = -DBL_MAX, max_y = -DBL_MAX, max_z = -DBL_MAX; 
@@ -84,6 +94,13 @@ void Triangle::getBoundingBox(Point &min, Point &max)
     max.z = max_z;
 }
 
+unsigned int Triangle::hash(unsigned int seed) const
+{
+    double values[12] = { a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z, normal.x, normal.y, normal.z };
+    seed = hashBytes(seed, values, sizeof(values));
+    return hashBytes(seed, &material, sizeof(material));
+}
+
 IntersectResult Triangle::intersect(Ray &ray)
 { 
     IntersectResult result(false);
@@ -162,6 +179,8 @@ IntersectResult Triangle::intersect(Ray &ray)
 
     result.hit = true;
     result.geometry = this;
+    result.facet = index;
+    result.material = material;
     result.distance = t;
     result.position = ray.getPoint(t);
     result.normal = normal;
@@ -13,10 +13,12 @@ public:
 public:
     Triangle();
     Triangle(const Point &a, const Point &b, const Point &c, const Vector &normal);
+    Triangle(const Point &a, const Point &b, const Point &c, const Vector &normal, int index); // thread safe
     Triangle(const Point &a, const Point &b, const Point &c);
     virtual Point getCenter() const;
-    virtual void getBoundingBox(Point &min, Point &max);
+    virtual void getBoundingBox(Point &min, Point &max) const;
     virtual IntersectResult intersect(Ray &ray);
+    virtual unsigned int hash(unsigned int seed) const;
     bool intersectWithGrid(const Grid &grid);
 };
 
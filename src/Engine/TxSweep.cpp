@@ -0,0 +1,133 @@
+#include "TxSweep.h"
+#include <algorithm>
+#include <string.h>
+
+TxSweep::TxSweep()
+{
+    Reset();
+}
+
+long long TxSweep::key(int rx, int hash_code)
+{
+    return ((long long)rx << 32) | (unsigned int)hash_code;
+}
+
+void TxSweep::Reset()
+{
+    Settings none;
+    memset(&none, 0, sizeof(Settings));
+    Reset(none);
+}
+
+void TxSweep::Reset(const Settings &settings)
+{
+    this->settings = settings;
+
+    paths.clear();
+    lookup.clear();
+    probes.assign(RegionCount(), 0);
+}
+
+bool TxSweep::Matches(const Settings &settings) const
+{
+    return this->settings.nColumns == settings.nColumns &&
+        this->settings.nRows == settings.nRows &&
+        this->settings.nRx == settings.nRx &&
+        this->settings.sceneGeneration == settings.sceneGeneration &&
+        this->settings.rxHash == settings.rxHash &&
+        this->settings.parameterHash == settings.parameterHash;
+}
+
+int TxSweep::RegionCount() const
+{
+    return settings.nColumns * ((settings.nRows + RowsPerRegion - 1) / RowsPerRegion);
+}
+
+int TxSweep::Region(int column, int row) const
+{
+    return column * ((settings.nRows + RowsPerRegion - 1) / RowsPerRegion) + row / RowsPerRegion;
+}
+
+void TxSweep::GetRows(int region, int &column, int &firstRow, int &lastRow) const
+{
+    int regionsPerColumn = (settings.nRows + RowsPerRegion - 1) / RowsPerRegion;
+    column = region / regionsPerColumn;
+    firstRow = (region % regionsPerColumn) * RowsPerRegion;
+    lastRow = std::min(firstRow + RowsPerRegion, settings.nRows);
+}
+
+void TxSweep::AddPath(int rx, int region, const RayPath &path, const std::vector<Geometry *> &reflections)
+{
+    long long k = key(rx, path.hash_code);
+    std::unordered_map<long long, int>::iterator it = lookup.find(k);
+    if (it != lookup.end()) // found by another ray before
+    {
+        std::vector<int> &regions = paths[it->second].regions;
+        if (std::find(regions.begin(), regions.end(), region) == regions.end())
+            regions.push_back(region);
+        return;
+    }
+
+    lookup[k] = (int)paths.size();
+
+    Path p;
+    p.rx = rx;
+    p.regions.push_back(region);
+    p.reflections = reflections;
+    paths.push_back(p);
+}
+
+const std::vector<TxSweep::Path> &TxSweep::GetPaths() const
+{
+    return paths;
+}
+
+void TxSweep::RemoveRegions(const std::vector<bool> &regions)
+{
+    std::vector<Path> kept;
+    lookup.clear();
+
+    for (unsigned int i = 0; i < paths.size(); i++)
+    {
+        std::vector<int> &found = paths[i].regions;
+        unsigned int n = 0;
+        for (unsigned int j = 0; j < found.size(); j++)
+        {
+            if (!regions[found[j]])
+                found[n++] = found[j];
+        }
+        found.resize(n);
+        if (n == 0)
+            continue;
+
+        RayPath path;
+        for (unsigned int j = 0; j < paths[i].reflections.size(); j++)
+        {
+            path.addPoint(paths[i].reflections[j]->index);
+        }
+        lookup[key(paths[i].rx, path.hash_code)] = (int)kept.size();
+        kept.push_back(paths[i]);
+    }
+
+    paths.swap(kept);
+}
+
+bool TxSweep::Found(const Path &path, const std::vector<bool> &regions)
+{
+    for (unsigned int i = 0; i < path.regions.size(); i++)
+    {
+        if (!regions[path.regions[i]])
+            return true;
+    }
+    return false;
+}
+
+void TxSweep::SetProbe(int region, int hash_code)
+{
+    probes[region] = hash_code;
+}
+
+int TxSweep::GetProbe(int region) const
+{
+    return probes[region];
+}
@@ -0,0 +1,70 @@
+#ifndef TX_SWEEP_H
+#define TX_SWEEP_H
+
+#include <vector>
+#include <unordered_map>
+#include "Geometry.h"
+
+// Reflection sequences kept between the steps of a tx sweep.
+//
+// The launch rays (or tubes) are grouped into small angular regions of
+// RowsPerRegion rays of a launch column, and the first ray of each region is
+// its probe. Every (rx, reflection sequence) pair found in a step is recorded
+// with all the regions whose rays found it. In the next step, a region is
+// reused when its probe ray still follows the same sequence and all of its
+// pairs are still valid at the new tx point; only the other regions are
+// traced again. A pair is kept while one of its regions is reused.
+class TxSweep
+{
+public:
+    // What the recorded paths depend on besides the tx point: a step with
+    // other settings is a full simulation
+    struct Settings
+    {
+        int nColumns; // see get_launch_size() in Engine.cpp
+        int nRows;
+        int nRx;
+        int sceneGeneration; // see sceneGeneration in Engine.cpp
+        unsigned int rxHash; // of the rx coordinates
+        unsigned int parameterHash; // of the simulation parameters and materials
+    };
+
+    struct Path
+    {
+        int rx;
+        std::vector<int> regions; // that found the path, in the order they found it
+        std::vector<Geometry *> reflections; // in the order of the path (tx -> rx)
+    };
+
+    static const int RowsPerRegion = 4;
+
+private:
+    Settings settings;
+    std::vector<Path> paths;
+    std::unordered_map<long long, int> lookup; // (rx, path hash) -> index of paths
+    std::vector<int> probes; // sequence hash of the probe ray of each region
+
+private:
+    static long long key(int rx, int hash_code);
+
+public:
+    TxSweep();
+
+    void Reset(); // nothing recorded
+    void Reset(const Settings &settings);
+    bool Matches(const Settings &settings) const; // recorded with the same settings?
+
+    int RegionCount() const;
+    int Region(int column, int row) const;
+    void GetRows(int region, int &column, int &firstRow, int &lastRow) const; // rows [firstRow, lastRow)
+
+    void AddPath(int rx, int region, const RayPath &path, const std::vector<Geometry *> &reflections);
+    const std::vector<Path> &GetPaths() const;
+    void RemoveRegions(const std::vector<bool> &regions); // drop the regions (to be retraced) from the paths
+    static bool Found(const Path &path, const std::vector<bool> &regions); // by one of the other regions?
+
+    void SetProbe(int region, int hash_code);
+    int GetProbe(int region) const;
+};
+
+#endif
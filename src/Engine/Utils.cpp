@@ -6,6 +6,7 @@
 #include "Utils.h"
 
 int Utils::startTime;
+static __declspec(thread) int pinnedNode = -1; // every thread pins itself
 
 void Utils::StartTimer()
 {
@@ -48,3 +49,59 @@ int Utils::GetMemorySize()
     GetProcessMemoryInfo(hProcess, &pmc, sizeof(pmc));
     return (int)pmc.PagefileUsage;
 }
+
+int Utils::GetNumaNodeCount()
+{
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest))
+        return 1;
+    return (int)highest + 1;
+}
+
+// The Ex functions see every processor group, not only the one of the process
+int Utils::GetCurrentNumaNode()
+{
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+
+    USHORT node = 0;
+    if (!GetNumaProcessorNodeEx(&processor, &node) || node == 0xFFFF)
+        return 0;
+    return (int)node;
+}
+
+int Utils::GetPinnedNumaNode()
+{
+    return pinnedNode;
+}
+
+Utils::ThreadAffinity Utils::PinThread(int node)
+{
+    ThreadAffinity result = { 0, 0 };
+
+    GROUP_AFFINITY affinity = {};
+    if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || affinity.Mask == 0)
+        return result;
+
+    // Moves the thread to the group of the node if needed
+    GROUP_AFFINITY previous = {};
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous))
+        return result;
+
+    pinnedNode = node;
+    result.group = previous.Group;
+    result.mask = previous.Mask;
+    return result;
+}
+
+void Utils::UnpinThread(const ThreadAffinity &affinity)
+{
+    if (affinity.mask != 0)
+    {
+        GROUP_AFFINITY previous = {};
+        previous.Group = affinity.group;
+        previous.Mask = (KAFFINITY)affinity.mask;
+        SetThreadGroupAffinity(GetCurrentThread(), &previous, NULL);
+    }
+    pinnedNode = -1;
+}
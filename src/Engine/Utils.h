@@ -3,6 +3,15 @@
 
 class Utils
 {
+public:
+    // Affinity of a thread within its processor group (mask 0 = none)
+    struct ThreadAffinity
+    {
+        unsigned short group;
+        unsigned long long mask;
+    };
+
+
 private:
     static int startTime;
 
@@ -18,6 +27,14 @@ public:
 
     // Memory
     static int GetMemorySize();
+
+    // NUMA nodes: a thread pinned to the processors of a node gets its memory
+    // from that node (first touch)
+    static int GetNumaNodeCount();
+    static int GetCurrentNumaNode();
+    static int GetPinnedNumaNode(); // of the calling thread, -1 = not pinned
+    static ThreadAffinity PinThread(int node); // returns the previous affinity, mask 0 = failed
+    static void UnpinThread(const ThreadAffinity &affinity);
 };
 
 #endif
@@ -0,0 +1,63 @@
+#include "Tests.h"
+#include "../Engine/Complex.h"
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+void TestComplex()
+{
+    // (1 + 2i) / (3 + 4i) = (11 + 2i) / 25
+    ComplexNumber q = ComplexNumber(1, 2) / ComplexNumber(3, 4);
+    CHECK_NEAR(q.a, 0.44, 1e-12);
+    CHECK_NEAR(q.b, 0.08, 1e-12);
+
+    // z / z = 1, whatever |z| is
+    ComplexNumber z(-7.5, 2.25);
+    ComplexNumber one = z / z;
+    CHECK_NEAR(one.a, 1, 1e-12);
+    CHECK_NEAR(one.b, 0, 1e-12);
+
+    // (q * z) / z = q
+    ComplexNumber back = (q * z) / z;
+    CHECK_NEAR(back.a, q.a, 1e-12);
+    CHECK_NEAR(back.b, q.b, 1e-12);
+
+    // Division by a real number
+    ComplexNumber half = ComplexNumber(3, -1) / ComplexNumber(2, 0);
+    CHECK_NEAR(half.a, 1.5, 1e-12);
+    CHECK_NEAR(half.b, -0.5, 1e-12);
+
+    // A Fresnel coefficient (sinPsi - sqrt(eps - cos^2)) / (sinPsi + sqrt(eps - cos^2))
+    // of a lossy medium is never larger than 1
+    for (int i = 1; i < 90; i++)
+    {
+        double psi = i * 3.14159265358979323846 / 180;
+        ComplexNumber eps(7.0, -0.0015 * 17975.1 / 2437.0);
+        ComplexNumber root = (eps - cos(psi) * cos(psi)).Sqrt();
+        ComplexNumber r = (ComplexNumber(sin(psi), 0) - root) / (ComplexNumber(sin(psi), 0) + root);
+        CHECK(r.a * r.a + r.b * r.b <= 1);
+    }
+
+    // The batched Euler() against libm: the phases of a few km at 2.4 GHz,
+    // the range reduction limit, and an odd count for the last phase
+    const int n = 20001;
+    std::vector<double> A(n), phi(n), re(n), im(n);
+    for (int i = 0; i < n; i++)
+    {
+        A[i] = 0.5 + (i % 7);
+        phi[i] = (i - n / 2) * 37.1234567;
+    }
+    phi[0] = 1e6 + 0.5;
+    phi[1] = -3e7;
+    phi[2] = 0;
+    phi[3] = -0.7853981633974483;
+    ComplexNumber::Euler(&A[0], &phi[0], &re[0], &im[0], n);
+
+    double maxError = 0;
+    for (int i = 0; i < n; i++)
+    {
+        maxError = std::max(maxError, fabs(re[i] - A[i] * cos(phi[i])) / A[i]);
+        maxError = std::max(maxError, fabs(im[i] - A[i] * sin(phi[i])) / A[i]);
+    }
+    CHECK(maxError < 1e-15);
+}
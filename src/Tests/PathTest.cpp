@@ -0,0 +1,100 @@
+#include "Tests.h"
+#include "../Engine/EdgeAcc.h"
+#include "../Engine/Triangle.h"
+#include "../Engine/Engine.h" // after the engine headers, its enums name Grid and KdTree
+
+static const int nRx = 41;
+
+// A plate across the line of sight and a wedge beside it, with rx points
+// behind the plate. A transmission through the plate and a diffraction on the
+// wedge reach every rx point.
+static const RtTriangle scene[3] =
+{
+    RtTriangle(RtPoint(10, -0.5, -0.5), RtPoint(10, 0.5, -0.5), RtPoint(10, 0, 0.6), RtVector(-1, 0, 0)), // plate
+    RtTriangle(RtPoint(10, 1, -5), RtPoint(10, 1, 5), RtPoint(8, 3, 0), RtVector(-0.7071, -0.7071, 0)),
+    RtTriangle(RtPoint(10, 1, 5), RtPoint(10, 1, -5), RtPoint(12, 3, 0), RtVector(0.7071, -0.7071, 0))
+};
+
+static RayPath single_point_path(int tag)
+{
+    RayPath path;
+    path.addPoint(tag);
+    return path;
+}
+
+// The tags of the facets and edges the scene creates must not collide,
+// whatever indexes the objects got
+static void check_tags()
+{
+    std::vector<Geometry *> facets;
+    for (int i = 0; i < 3; i++)
+    {
+        const RtTriangle &t = scene[i];
+        facets.push_back(new Triangle(Point(t.a.x, t.a.y, t.a.z), Point(t.b.x, t.b.y, t.b.z),
+            Point(t.c.x, t.c.y, t.c.z), Vector(t.n.x, t.n.y, t.n.z)));
+    }
+    EdgeAcc edges;
+    edges.build(facets, 10 * PI / 180); // as the engine does
+    CHECK(edges.size() == 1); // the wedge
+
+    // The wedge edge, and the edge index one below the plate's: a transmission
+    // through facet f and a diffraction on edge f - 1 used to be one path
+    int facet = facets[0]->index;
+    int candidates[2] = { edges.size() > 0 ? edges.get(0).index : 0, facet - 1 };
+    RayPath reflected = single_point_path(facet);
+    RayPath transmitted = single_point_path(RayPath::transmission(facet));
+    CHECK(!(reflected == transmitted));
+    for (int i = 0; i < 2; i++)
+    {
+        RayPath diffracted = single_point_path(RayPath::diffraction(candidates[i]));
+        CHECK(!(diffracted == reflected));
+        CHECK(!(diffracted == transmitted));
+    }
+
+    for (unsigned int i = 0; i < facets.size(); i++)
+    {
+        delete facets[i];
+    }
+}
+
+static void simulate(bool diffraction, bool transmission, int *counts)
+{
+    Initialize();
+
+    AddTriangles(scene, 3);
+
+    SetPreprocessMethod(RtPreprocessMethod::KdTree);
+    SetTxPoint(RtPoint(0, 0, 0), 20);
+    RtPoint rxPoints[nRx];
+    for (int i = 0; i < nRx; i++)
+    {
+        rxPoints[i] = RtPoint(20, -0.4 + i * 0.02, 0);
+    }
+    SetRxPoints(rxPoints, nRx, 0.3);
+    SetParameters(7.0, 0.0015, 2, 0.25, 2437.0);
+    SetDiffraction(diffraction, 2);
+    SetTransmission(transmission, 0.2, 2, 60, 64);
+    Simulate();
+    GetRxPathCounts(counts, nRx);
+}
+
+// Transmitted and diffracted paths must stay apart with both features on:
+// the diffracted paths add the same number of paths with and without
+// transmission
+void TestPathTags()
+{
+    check_tags();
+
+    int both[nRx], transmitted[nRx], diffracted[nRx], neither[nRx];
+    simulate(true, true, both);
+    simulate(false, true, transmitted);
+    simulate(true, false, diffracted);
+    simulate(false, false, neither);
+
+    for (int i = 0; i < nRx; i++)
+    {
+        CHECK(transmitted[i] > neither[i]); // through the plate
+        CHECK(diffracted[i] > neither[i]);
+        CHECK(both[i] - transmitted[i] == diffracted[i] - neither[i]);
+    }
+}
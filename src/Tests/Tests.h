@@ -0,0 +1,25 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+#include <stdio.h>
+
+// Every failed check prints its location and is counted,
+// main() returns the number of failed checks
+extern int failures;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+#define CHECK_NEAR(value, expected, tolerance) CHECK(fabs((value) - (expected)) <= (tolerance))
+
+void TestComplex();
+void TestPathTags();
+
+#endif
@@ -0,0 +1,15 @@
+#include "Tests.h"
+
+int failures = 0;
+
+int main()
+{
+    TestComplex();
+    TestPathTags();
+
+    if (failures == 0)
+        fprintf(stderr, "All tests passed\n");
+    else
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures;
+}